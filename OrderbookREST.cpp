@@ -10,10 +10,17 @@
 #include <sstream>
 #include <iomanip>
 #include <ctime>
+#include <cmath>
+#include <optional>
+#include <limits>
 #include <curl/curl.h>
 
 // Your orderbook types
+#ifdef ORDERBOOK_PRICE64
+using Price = std::int64_t;  // -DORDERBOOK_PRICE64 for high priced symbols or more decimals
+#else
 using Price = std::int32_t;
+#endif
 using Quantity = std::uint32_t;
 using OrderId = std::uint64_t;
 
@@ -65,6 +72,31 @@ private:
 
 using OrderPointer = std::shared_ptr<Order>;
 
+// Fixed point price for one symbol: integer count of 10^-decimals, on a multiple of the tick
+// Same conversions and defaults as PriceSpec in multiTypeOrderbook.cpp (tick of 1, no decimals)
+class PriceSpec {
+public:
+    explicit PriceSpec(Price tickSize = 1, std::uint8_t decimals = 0)
+        : tickSize_(tickSize)
+        , scale_(std::pow(10.0, decimals))
+    { }
+
+    // Round to the nearest tick instead of truncating (123.45 * 100 is 12344.999...)
+    std::optional<Price> FromDecimal(double value) const {
+        double ticks = std::round(value * scale_ / tickSize_);
+        double limit = static_cast<double>(std::numeric_limits<Price>::max()) / tickSize_;
+        if (!std::isfinite(ticks) || ticks > limit || ticks < -limit)
+            return std::nullopt;
+        return static_cast<Price>(static_cast<std::int64_t>(ticks) * tickSize_);
+    }
+
+    double ToDecimal(Price price) const { return price / scale_; }
+
+private:
+    Price tickSize_;
+    double scale_;
+};
+
 // JSON PARCER
 
 class SimpleJsonParser {
@@ -400,12 +432,17 @@ private:
     std::vector<OrderPointer> localBids_;
     std::vector<OrderPointer> localAsks_;
     OrderId nextOrderId_;
+    PriceSpec priceSpec_;
     
 public:
-    OrderbookManager(AlpacaRestAPI& api, const std::string& symbol)
+    // US equities quote in cents by default. Sub-dollar symbols trade in 4 decimals
+    static PriceSpec Cents() { return PriceSpec{ 1, 2 }; }
+
+    OrderbookManager(AlpacaRestAPI& api, const std::string& symbol, const PriceSpec& priceSpec = Cents())
         : api_(api)
         , symbol_(symbol)
         , nextOrderId_(1)
+        , priceSpec_(priceSpec)
     { }
     
     // Fetch and update local orderbook from exchange
@@ -433,23 +470,26 @@ public:
         double bidPrice = SimpleJsonParser::extractDouble(response, "bp");
         int bidSize = SimpleJsonParser::extractInt(response, "bs");
         
-        if (bidPrice > 0 && bidSize > 0) {
+        auto bidTicks = priceSpec_.FromDecimal(bidPrice);
+        auto askTicks = priceSpec_.FromDecimal(askPrice);
+        
+        if (bidPrice > 0 && bidSize > 0 && bidTicks) {
             auto bidOrder = std::make_shared<Order>(
                 OrderType::GoodTillCancel,
                 nextOrderId_++,
                 Side::Buy,
-                static_cast<Price>(bidPrice * 100),  // Convert to cents
+                *bidTicks,
                 static_cast<Quantity>(bidSize)
             );
             localBids_.push_back(bidOrder);
         }
         
-        if (askPrice > 0 && askSize > 0) {
+        if (askPrice > 0 && askSize > 0 && askTicks) {
             auto askOrder = std::make_shared<Order>(
                 OrderType::GoodTillCancel,
                 nextOrderId_++,
                 Side::Sell,
-                static_cast<Price>(askPrice * 100),
+                *askTicks,
                 static_cast<Quantity>(askSize)
             );
             localAsks_.push_back(askOrder);
@@ -467,15 +507,15 @@ public:
         // Print asks (highest to lowest)
         int askCount = std::min(levels, (int)localAsks_.size());
         for (int i = askCount - 1; i >= 0; i--) {
-            double price = localAsks_[i]->GetPrice() / 100.0;
+            double price = priceSpec_.ToDecimal(localAsks_[i]->GetPrice());
             int qty = localAsks_[i]->GetRemainingQuantity();
             printf("║ ASK  $%-8.2f  x  %-6d   ║\n", price, qty);
         }
         
         // Calculate spread
         if (!localBids_.empty() && !localAsks_.empty()) {
-            double bidPrice = localBids_[0]->GetPrice() / 100.0;
-            double askPrice = localAsks_[0]->GetPrice() / 100.0;
+            double bidPrice = priceSpec_.ToDecimal(localBids_[0]->GetPrice());
+            double askPrice = priceSpec_.ToDecimal(localAsks_[0]->GetPrice());
             double spread = askPrice - bidPrice;
             double spreadPercent = (spread / askPrice) * 100.0;
             printf("║ ─ SPREAD: $%.2f (%.2f%%) ─   ║\n", spread, spreadPercent);
@@ -484,7 +524,7 @@ public:
         // Print bids (highest to lowest)
         int bidCount = std::min(levels, (int)localBids_.size());
         for (int i = 0; i < bidCount; i++) {
-            double price = localBids_[i]->GetPrice() / 100.0;
+            double price = priceSpec_.ToDecimal(localBids_[i]->GetPrice());
             int qty = localBids_[i]->GetRemainingQuantity();
             printf("║ BID  $%-8.2f  x  %-6d   ║\n", price, qty);
         }
@@ -493,11 +533,11 @@ public:
     }
     
     double GetBestBid() const {
-        return localBids_.empty() ? 0.0 : localBids_[0]->GetPrice() / 100.0;
+        return localBids_.empty() ? 0.0 : priceSpec_.ToDecimal(localBids_[0]->GetPrice());
     }
     
     double GetBestAsk() const {
-        return localAsks_.empty() ? 0.0 : localAsks_[0]->GetPrice() / 100.0;
+        return localAsks_.empty() ? 0.0 : priceSpec_.ToDecimal(localAsks_[0]->GetPrice());
     }
     
     double GetMidPrice() const {
@@ -17,12 +17,45 @@
 #include <tuple>
 #include <format>
 #include <list>
+#include <iomanip>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <memory_resource>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 
 enum class OrderType
 {
     GoodTillCancel,
-    FillandKill
+    FillandKill,
+    GoodTillDate, //Expires at its own timestamp
+    GoodForDay //Expires at session end
 };
 
 enum class Side
@@ -31,9 +64,172 @@ enum class Side
     Sell
 };
 
+//What to do when the two sides of a would-be trade have the same owner
+enum class SelfTradePrevention
+{
+    None,
+    CancelResting,
+    CancelAggressor,
+    CancelBoth,
+    Decrement //Both reduced by the smaller remaining quantity without printing a trade, smaller one goes away
+};
+
+enum class TradingPhase
+{
+    Continuous, //Every add matches straight away
+    Auction //Orders only accumulate until Uncross
+};
+
+#ifdef ORDERBOOK_PRICE64
+using Price = std::int64_t; //Build with -DORDERBOOK_PRICE64 for high priced instruments or many decimals
+#else
 using Price = std::int32_t; //Price can be negative
+#endif
 using Quantity = std::uint32_t; //Quantity cannot be negative so use unsigned int
 using OrderId = std::uint64_t; //OrderID cannot be negative so use unsigned int
+using OrderIds = std::vector<OrderId>;
+using Timestamp = std::uint64_t; //Nanoseconds on whatever clock the caller drives the book with
+using OwnerId = std::uint32_t; //Account/participant that owns an order
+constexpr OwnerId NoOwner = 0; //Orders nobody claimed. Never treated as trading with themselves
+
+//Fixed point price spec of one instrument. A Price counts units of 10^-decimals, and a valid one is a multiple of the tick size
+//Price to tick index is an exact division, done as a shift by the tick's power of two and a multiply by the inverse of its odd part
+//mod 2^64. Both are worked out once here, so indexing by tick never divides or branches
+class PriceSpec
+{
+public:
+    explicit PriceSpec(Price tickSize = 1, std::uint8_t decimals = 0)
+    : tickSize_{ tickSize }
+    , decimals_{ decimals }
+    {
+        if (tickSize <= 0)
+            throw std::logic_error("Tick size must be positive");
+        if (decimals > 18)
+            throw std::logic_error("At most 18 decimals fit a 64 bit price");
+
+        shift_ = std::countr_zero(static_cast<std::uint64_t>(tickSize));
+        const std::uint64_t odd = static_cast<std::uint64_t>(tickSize) >> shift_;
+        inverse_ = odd; //Right to 3 bits for any odd number, each Newton step doubles that
+        for (int step = 0; step < 5; ++step)
+            inverse_ *= 2 - odd * inverse_;
+        divisibleBound_ = static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()) / odd;
+        for (std::uint8_t digit = 0; digit < decimals; ++digit)
+            scale_ *= 10;
+    }
+
+    Price GetTickSize() const { return tickSize_; }
+    std::uint8_t GetDecimals() const { return decimals_; }
+
+    //Exact for prices on the tick, which is all the book holds
+    std::int64_t ToTicks(Price price) const
+    {
+        return static_cast<std::int64_t>(static_cast<std::uint64_t>(std::int64_t{ price } >> shift_) * inverse_);
+    }
+    Price FromTicks(std::int64_t ticks) const { return static_cast<Price>(ticks * tickSize_); }
+
+    //Low bits clear for the power of two, then the multiply by inverse lands in a small window only for multiples of the odd part
+    bool IsOnTick(Price price) const
+    {
+        const std::uint64_t lowBits = (std::uint64_t{ 1 } << shift_) - 1;
+        const std::uint64_t odd = static_cast<std::uint64_t>(std::int64_t{ price } >> shift_) * inverse_ + divisibleBound_;
+        return (static_cast<std::uint64_t>(price) & lowBits) == 0 && odd <= 2 * divisibleBound_;
+    }
+
+    Price RoundDown(Price price) const
+    {
+        const Price remainder = price % tickSize_;
+        return price - (remainder < 0 ? remainder + tickSize_ : remainder);
+    }
+    Price RoundUp(Price price) const
+    {
+        const Price down = RoundDown(price);
+        return down == price ? price : down + tickSize_;
+    }
+    //Halfway rounds up
+    Price RoundNearest(Price price) const
+    {
+        const Price down = RoundDown(price);
+        return 2 * (price - down) < tickSize_ ? down : down + tickSize_;
+    }
+
+    //price + ticks * tick size, nullopt if that does not fit a Price
+    std::optional<Price> Offset(Price price, std::int64_t ticks) const
+    {
+        Price distance = 0;
+        Price result = 0;
+        if (__builtin_mul_overflow(ticks, tickSize_, &distance) || __builtin_add_overflow(price, distance, &result))
+            return std::nullopt;
+        return result;
+    }
+
+    //Decimal to the nearest tick, rounded properly (123.45 is 12345 at 2 decimals, not 12344). nullopt if it does not fit
+    std::optional<Price> FromDecimal(double value) const
+    {
+        const double ticks = std::round(value * static_cast<double>(scale_) / static_cast<double>(tickSize_));
+        const double limit = static_cast<double>(std::numeric_limits<Price>::max()) / static_cast<double>(tickSize_);
+        if (!std::isfinite(ticks) || ticks > limit || ticks < -limit)
+            return std::nullopt;
+        return FromTicks(static_cast<std::int64_t>(ticks));
+    }
+    double ToDecimal(Price price) const { return static_cast<double>(price) / static_cast<double>(scale_); }
+
+private:
+    Price tickSize_;
+    std::uint8_t decimals_;
+    int shift_{ 0 };
+    std::uint64_t inverse_{ 1 };
+    std::uint64_t divisibleBound_{ 0 };
+    std::int64_t scale_{ 1 };
+};
+
+//Nanoseconds off the CPU timestamp counter, on the same timeline as steady_clock. Calibrated once against steady_clock,
+//after that a read is rdtsc and a fixed point multiply instead of a clock call. Needs an invariant TSC (any recent x86-64),
+//anything else falls back to steady_clock
+class TscClock
+{
+public:
+    //Calibration spins for a while, so share one per process
+    static const TscClock& Get()
+    {
+        static const TscClock clock{ std::chrono::milliseconds{ 20 } };
+        return clock;
+    }
+
+    explicit TscClock(std::chrono::nanoseconds calibration)
+    {
+#if defined(__x86_64__)
+        const auto wallStart = Clock::now();
+        const std::uint64_t ticksStart = __rdtsc();
+        auto wallEnd = wallStart;
+        while (wallEnd - wallStart < calibration)
+            wallEnd = Clock::now();
+        const std::uint64_t ticksEnd = __rdtsc();
+        const double nanosecondsPerTick = std::chrono::duration<double, std::nano>(wallEnd - wallStart).count() / static_cast<double>(ticksEnd - ticksStart);
+        multiplier_ = static_cast<std::uint64_t>(nanosecondsPerTick * 4294967296.0); //32.32 fixed point
+        baseTicks_ = ticksEnd;
+        baseNanoseconds_ = static_cast<Timestamp>(std::chrono::duration_cast<std::chrono::nanoseconds>(wallEnd.time_since_epoch()).count());
+#else
+        (void)calibration;
+#endif
+    }
+
+    Timestamp Now() const
+    {
+#if defined(__x86_64__)
+        const std::uint64_t ticks = __rdtsc() - baseTicks_;
+        return baseNanoseconds_ + static_cast<Timestamp>((static_cast<unsigned __int128>(ticks) * multiplier_) >> 32);
+#else
+        return static_cast<Timestamp>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count());
+#endif
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::uint64_t baseTicks_{ 0 };
+    Timestamp baseNanoseconds_{ 0 };
+    std::uint64_t multiplier_{ 0 };
+};
 
 //An order book can be thought of as two levels. Price and Quantity
 //Struct LevelInfo will be used for some public API to get the state of the order book
@@ -65,17 +261,128 @@ private:
 //We have everything we need to represent internal state of order book
 // Describe what we need to add to book. Order objects. Order objects contain type, ID, side, quantity, filled, etc
 
+//Optional order attributes, packed into one byte on the order
+enum class OrderAttribute : std::uint8_t
+{
+    None = 0,
+    PostOnly = 1 << 0, //Rejected if it would take liquidity on entry
+    PostOnlyReprice = 1 << 1, //Would take liquidity on entry, so it is moved one tick behind the opposite touch instead
+    Hidden = 1 << 2, //Never displayed. Trades after all displayed quantity at its price
+    MinimumQuantity = 1 << 3, //If it would trade on entry, at least GetMinimumQuantity must be executable against the price levels, otherwise rejected. Otherwise it rests as usual
+    Pegged = 1 << 4, //Price follows the touch, see PegReference
+    AllOrNone = 1 << 5 //Waits off the price levels until its whole remaining quantity can trade in one go
+};
+
+//What a pegged order's price follows. Offset is added on top
+enum class PegReference : std::uint8_t
+{
+    Primary, //Same side best (best bid for a buy)
+    Market, //Opposite side best (best ask for a buy)
+    Midpoint //Between best bid and ask, rounded away from the opposite side
+};
+
+constexpr OrderAttribute operator|(OrderAttribute lhs, OrderAttribute rhs)
+{
+    return static_cast<OrderAttribute>(static_cast<std::uint8_t>(lhs) | static_cast<std::uint8_t>(rhs));
+}
+
+class Order;
+
+//Intrusive doubly linked hook. Side structures of the book (expiry wheel etc) link orders through a hook living inside the Order, so no node is allocated
+//Unlinked hook points at itself, so Unlink is always safe to call
+struct OrderHook
+{
+    OrderHook() = default;
+    OrderHook(const OrderHook&) : OrderHook() { } //Copies start out unlinked
+    OrderHook& operator=(const OrderHook&) { return *this; }
+    ~OrderHook() { Unlink(); }
+
+    bool IsLinked() const { return next_ != this; }
+    void Unlink()
+    {
+        prev_->next_ = next_;
+        next_->prev_ = prev_;
+        prev_ = next_ = this;
+    }
+
+    OrderHook* prev_{ this };
+    OrderHook* next_{ this };
+    Order* order_{ nullptr };
+};
+
+//Circular list of hooks with a sentinel. Sentinel lives in the list object, so lists cannot be copied or moved around
+class OrderHookList
+{
+public:
+    OrderHookList() = default;
+    OrderHookList(const OrderHookList&) = delete;
+    OrderHookList& operator=(const OrderHookList&) = delete;
+    ~OrderHookList() { while (!empty()) head_.next_->Unlink(); }
+
+    bool empty() const { return head_.next_ == &head_; }
+
+    void PushBack(Order& order, OrderHook& hook)
+    {
+        hook.order_ = &order;
+        hook.prev_ = head_.prev_;
+        hook.next_ = &head_;
+        head_.prev_->next_ = &hook;
+        head_.prev_ = &hook;
+    }
+
+    Order& PopFront()
+    {
+        OrderHook* hook = head_.next_;
+        hook->Unlink();
+        return *hook->order_;
+    }
+
+    template <typename Function>
+    void ForEach(Function&& function) const
+    {
+        for (const OrderHook* hook = head_.next_; hook != &head_; hook = hook->next_)
+            function(*hook->order_);
+    }
+
+    //Moves every hook of other to the back of this list in O(1)
+    void Splice(OrderHookList& other)
+    {
+        if (other.empty())
+            return;
+        OrderHook* first = other.head_.next_;
+        OrderHook* last = other.head_.prev_;
+        other.head_.next_ = other.head_.prev_ = &other.head_;
+        first->prev_ = head_.prev_;
+        last->next_ = &head_;
+        head_.prev_->next_ = first;
+        head_.prev_ = last;
+    }
+
+private:
+    OrderHook head_;
+};
+
 class Order
 {
 public:
     Order(OrderType orderType, OrderId orderId, Side side, Price price, Quantity quantity)
+    : Order(orderType, orderId, side, price, quantity, quantity)
+    { }
+
+    //Iceberg (reserve) order. Only displayQuantity is ever visible on the book, the rest is held back as a hidden reserve
+    Order(OrderType orderType, OrderId orderId, Side side, Price price, Quantity quantity, Quantity displayQuantity)
     : orderType_{ orderType }
     , orderId_{ orderId }
     , side_{ side }
     , price_{ price }
     , initialQuantity_{ quantity } //Three different quantities: initial quantity of the order, quantity remaining, quantity filled. We need to keep track of two
     , remainingQuantity_{ quantity }
-    { }
+    , displayQuantity_{ std::min(displayQuantity, quantity) }
+    , visibleQuantity_{ displayQuantity_ }
+    {
+        if (displayQuantity == 0)
+            throw std::logic_error("Order cannot have a display quantity of zero");
+    }
 
     OrderId GetOrderId() const { return orderId_; }
     Side GetSide() const { return side_; }
@@ -85,15 +392,79 @@ public:
     Quantity GetRemainingQuantity() const { return remainingQuantity_; }
     Quantity GetFilledQuantity() const { return GetInitialQuantity() - GetRemainingQuantity(); }
     bool isFilled() const { return GetRemainingQuantity() == 0; }
+    //Display slice size, and how much of the current slice is left. For a plain order both just follow the remaining quantity
+    Quantity GetDisplayQuantity() const { return displayQuantity_; }
+    Quantity GetVisibleQuantity() const { return visibleQuantity_; }
+    Quantity GetReserveQuantity() const { return GetRemainingQuantity() - GetVisibleQuantity(); }
+    bool IsIceberg() const { return GetDisplayQuantity() < GetInitialQuantity(); }
+    //Only meaningful for GoodTillDate. Order is expired once the book clock reaches this
+    Timestamp GetExpiry() const { return expiry_; }
+    void SetExpiry(Timestamp expiry) { expiry_ = expiry; }
+    OrderHook& GetExpiryHook() { return expiryHook_; }
+    OwnerId GetOwner() const { return owner_; }
+    void SetOwner(OwnerId owner) { owner_ = owner; }
+    OrderHook& GetOwnerHook() { return ownerHook_; }
+    //True if the order has any of the given attributes
+    bool HasAttribute(OrderAttribute attribute) const { return (attributes_ & static_cast<std::uint8_t>(attribute)) != 0; }
+    void AddAttributes(OrderAttribute attributes) { attributes_ |= static_cast<std::uint8_t>(attributes); }
+    OrderAttribute GetAttributes() const { return static_cast<OrderAttribute>(attributes_); }
+    bool IsHidden() const { return HasAttribute(OrderAttribute::Hidden); }
+    Quantity GetMinimumQuantity() const { return minimumQuantity_; }
+    void SetMinimumQuantity(Quantity quantity)
+    {
+        minimumQuantity_ = quantity;
+        AddAttributes(OrderAttribute::MinimumQuantity);
+    }
+    //Part of the order the market sees. Hidden orders show nothing, icebergs show their current slice
+    Quantity GetShownQuantity() const { return IsHidden() ? 0 : GetVisibleQuantity(); }
+    //Only before the order rests (post-only reprice)
+    void Reprice(Price price) { price_ = price; }
+    //Pegged orders rest off the price levels and are priced off the touch when reached. Their own price is not used by the book
+    bool IsPegged() const { return HasAttribute(OrderAttribute::Pegged); }
+    bool IsAllOrNone() const { return HasAttribute(OrderAttribute::AllOrNone); }
+    PegReference GetPegReference() const { return pegReference_; }
+    Price GetPegOffset() const { return pegOffset_; }
+    void SetPeg(PegReference reference, Price offset)
+    {
+        pegReference_ = reference;
+        pegOffset_ = offset;
+        AddAttributes(OrderAttribute::Pegged);
+    }
     //Now need to get APi to fill us
     //when a trade happens, lowest quantity associated between both orders is the quantity used to fill both orders
     void Fill(Quantity quantity)
     {
-        if (quantity > GetRemainingQuantity())
-            throw std::logic_error("Order cannot be filled: quantity exceeds remaining quantity");
+        if (quantity > GetVisibleQuantity())
+            throw std::logic_error("Order cannot be filled: quantity exceeds visible quantity");
         
         remainingQuantity_ -= quantity;
+        visibleQuantity_ -= quantity;
     }
+    //Quantity taken away without a trade (self-trade decrement). Comes out of the hidden reserve first
+    void Decrement(Quantity quantity)
+    {
+        if (quantity > GetRemainingQuantity())
+            throw std::logic_error("Order cannot be decremented: quantity exceeds remaining quantity");
+
+        remainingQuantity_ -= quantity;
+        visibleQuantity_ = std::min(visibleQuantity_, remainingQuantity_);
+    }
+    //Display slice is used up but there is still reserve. Show the next slice. Book is responsible for moving us to the back of the queue
+    void Replenish()
+    {
+        visibleQuantity_ = std::min(GetDisplayQuantity(), GetRemainingQuantity());
+    }
+    //Book wide event sequence and the time of the command that brought the order in (0 unless the book has a clock)
+    std::uint64_t GetSequence() const { return sequence_; }
+    Timestamp GetEntryTime() const { return entryTime_; }
+    void Stamp(std::uint64_t sequence, Timestamp time)
+    {
+        sequence_ = sequence;
+        entryTime_ = time;
+    }
+    //Where the order joined its queue, only meaningful to the level's QueuePositions
+    std::uint32_t GetQueueSlot() const { return queueSlot_; }
+    void SetQueueSlot(std::uint32_t slot) { queueSlot_ = slot; }
 
 private:
     OrderType orderType_;
@@ -102,13 +473,161 @@ private:
     Price price_;
     Quantity initialQuantity_;
     Quantity remainingQuantity_;
+    Quantity displayQuantity_;
+    Quantity visibleQuantity_;
+    Timestamp expiry_{ 0 };
+    OrderHook expiryHook_;
+    OwnerId owner_{ 0 };
+    OrderHook ownerHook_;
+    std::uint8_t attributes_{ 0 };
+    PegReference pegReference_{ PegReference::Primary };
+    Quantity minimumQuantity_{ 0 };
+    Price pegOffset_{ 0 };
+    std::uint32_t queueSlot_{ 0 };
+    std::uint64_t sequence_{ 0 };
+    Timestamp entryTime_{ 0 };
 }; 
 
 //Want reference semantics to make things easier
 using OrderPointer = std::shared_ptr<Order>;
 //List gives us an iterator that cannot be invalidated despite the list growing very large. Useful to see where our order is in bids/ask orderbook
 //Cost and tradeoffs. Not gonna be super high level, but gets the job done
-using OrderPointers = std::list<OrderPointer>;
+//pmr so a book can keep its nodes in its own arena
+using OrderPointers = std::pmr::list<OrderPointer>;
+
+//Visible quantity ahead of each order in one queue. Orders take increasing slots as they join the back and a Fenwick tree over
+//the slots holds their visible quantity, so quantity ahead is one prefix sum and fills/cancels are one point update, both O(log n)
+//Nothing is kept until the first question about a queue, so levels nobody asks about pay one branch per update
+class QueuePositions
+{
+public:
+    bool IsTracking() const { return !tree_.empty(); }
+
+    //Slots for the whole queue in list order. Leaves room for as many again to join before the next rebuild
+    void Build(const OrderPointers& queue)
+    {
+        tree_.assign(std::bit_ceil(std::max<std::size_t>(16, queue.size() * 2)) + 1, 0);
+        next_ = 0;
+        for (const auto& order : queue)
+        {
+            order->SetQueueSlot(next_++);
+            tree_[next_] = order->GetVisibleQuantity();
+        }
+        for (std::size_t index = 1; index < tree_.size(); ++index) //Linear build, each node passes its sum to its parent
+        {
+            const std::size_t parent = index + (index & (~index + 1));
+            if (parent < tree_.size())
+                tree_[parent] += tree_[index];
+        }
+    }
+
+    //Order was just put at the back of queue. Its slot starts at zero, the level adds its quantity
+    void Join(const OrderPointers& queue, Order& order)
+    {
+        if (next_ + 1 < tree_.size())
+        {
+            order.SetQueueSlot(next_++);
+            return;
+        }
+        Build(queue); //Out of slots. Renumbering compacts away everything that has left
+        Update(order, -std::int64_t{ order.GetVisibleQuantity() });
+    }
+
+    void Update(const Order& order, std::int64_t delta)
+    {
+        for (std::size_t index = order.GetQueueSlot() + 1; index < tree_.size(); index += index & (~index + 1))
+            tree_[index] += static_cast<std::uint64_t>(delta); //Wraps back for negative deltas
+    }
+
+    std::uint64_t Ahead(const Order& order) const
+    {
+        std::uint64_t ahead = 0;
+        for (std::size_t index = order.GetQueueSlot(); index > 0; index &= index - 1)
+            ahead += tree_[index];
+        return ahead;
+    }
+
+private:
+    std::vector<std::uint64_t> tree_; //1 based, slot s is at s + 1
+    std::uint32_t next_{ 0 };
+};
+
+//One price level. Displayed orders in time priority, fully hidden orders queued behind them, plus running totals
+//Shown and hidden size are kept apart so snapshots and depth never have to walk the orders to filter hidden size out
+struct PriceLevel
+{
+    OrderPointers orders_; //Displayed, icebergs included. Trade first
+    OrderPointers hidden_; //Fully hidden. Trade once nothing displayed is left at this price
+    Quantity displayedQuantity_{ 0 }; //What the market sees
+    Quantity hiddenQuantity_{ 0 }; //Hidden orders plus iceberg reserve
+    QueuePositions displayedPositions_;
+    QueuePositions hiddenPositions_;
+
+    //Levels take their queues' allocator from the map they live in
+    using allocator_type = std::pmr::polymorphic_allocator<OrderPointer>;
+    PriceLevel() = default;
+    explicit PriceLevel(const allocator_type& allocator)
+    : orders_{ allocator }
+    , hidden_{ allocator }
+    { }
+
+    Quantity GetTotalQuantity() const { return displayedQuantity_ + hiddenQuantity_; }
+    std::size_t GetOrderCount() const { return orders_.size() + hidden_.size(); }
+    bool IsEmpty() const { return orders_.empty() && hidden_.empty(); }
+    //Queue the next fill at this price comes from
+    OrderPointers& GetFrontQueue() { return orders_.empty() ? hidden_ : orders_; }
+    OrderPointers& GetQueue(const Order& order) { return order.IsHidden() ? hidden_ : orders_; }
+    QueuePositions& GetPositions(const Order& order) { return order.IsHidden() ? hiddenPositions_ : displayedPositions_; }
+
+    //Order just went to the back of its queue (new, or an iceberg showing its next slice). Add/OnReplenish count its quantity
+    void Join(Order& order)
+    {
+        if (auto& positions = GetPositions(order); positions.IsTracking()) [[unlikely]]
+            positions.Join(GetQueue(order), order);
+    }
+    void Add(const Order& order)
+    {
+        displayedQuantity_ += order.GetShownQuantity();
+        hiddenQuantity_ += order.GetRemainingQuantity() - order.GetShownQuantity();
+        Track(order, order.GetVisibleQuantity());
+    }
+    void Remove(const Order& order)
+    {
+        displayedQuantity_ -= order.GetShownQuantity();
+        hiddenQuantity_ -= order.GetRemainingQuantity() - order.GetShownQuantity();
+        Track(order, -std::int64_t{ order.GetVisibleQuantity() });
+    }
+    //Fills always come out of the visible slice, which is shown unless the whole order is hidden
+    void OnFill(const Order& order, Quantity quantity)
+    {
+        (order.IsHidden() ? hiddenQuantity_ : displayedQuantity_) -= quantity;
+        Track(order, -std::int64_t{ quantity });
+    }
+    //Iceberg showed its next slice, that much moves from hidden to displayed
+    void OnReplenish(const Order& order)
+    {
+        displayedQuantity_ += order.GetShownQuantity();
+        hiddenQuantity_ -= order.GetShownQuantity();
+        Track(order, order.GetVisibleQuantity());
+    }
+
+    //Visible quantity that trades before this order here. Hidden orders are behind everything displayed
+    //First call for a queue numbers it, O(n). After that O(log n)
+    Quantity GetQuantityAhead(const Order& order)
+    {
+        auto& positions = GetPositions(order);
+        if (!positions.IsTracking())
+            positions.Build(GetQueue(order));
+        return static_cast<Quantity>(positions.Ahead(order)) + (order.IsHidden() ? displayedQuantity_ : 0);
+    }
+
+private:
+    void Track(const Order& order, std::int64_t delta)
+    {
+        if (auto& positions = GetPositions(order); positions.IsTracking()) [[unlikely]]
+            positions.Update(order, delta);
+    }
+};
 
 //Want to create an abstraction for an order that needs to be modified. Add, modified, cancel
 class OrderModify
@@ -125,9 +644,15 @@ public:
     Side GetSide() const { return side_; }
     Quantity GetQuantity() const { return quantity_; }
     //We will have one more public API that converts a given order that exists, transforming it into a new order
-    OrderPointer ToOrderPointer(OrderType type) const
+    //Allocated from memory, so a book on an arena keeps replacements in it
+    OrderPointer ToOrderPointer(OrderType type, std::pmr::memory_resource* memory = std::pmr::get_default_resource()) const
+    {
+        return std::allocate_shared<Order>(std::pmr::polymorphic_allocator<Order>{ memory }, type, GetOrderId(), GetSide(), GetPrice(), GetQuantity());
+    }
+    //Same as above but keeps the display slice size of an iceberg that is being modified
+    OrderPointer ToOrderPointer(OrderType type, Quantity displayQuantity, std::pmr::memory_resource* memory = std::pmr::get_default_resource()) const
     {
-        return std::make_shared<Order>(type, GetOrderId(), GetSide(), GetPrice(), GetQuantity());
+        return std::allocate_shared<Order>(std::pmr::polymorphic_allocator<Order>{ memory }, type, GetOrderId(), GetSide(), GetPrice(), GetQuantity(), displayQuantity);
     }
 
 private:
@@ -155,220 +680,4980 @@ public:
 
     const TradeInfo& GetBidTrade() const { return bidTrade_; }
     const TradeInfo& GetAskTrade() const { return askTrade_; }
+    //Same sequence as orders, so a trade is always after the orders in it. Time is the command's, 0 unless the book has a clock
+    std::uint64_t GetSequence() const { return sequence_; }
+    Timestamp GetTime() const { return time_; }
+    void Stamp(std::uint64_t sequence, Timestamp time)
+    {
+        sequence_ = sequence;
+        time_ = time;
+    }
 
 private: 
     TradeInfo bidTrade_;
     TradeInfo askTrade_;
+    std::uint64_t sequence_{ 0 };
+    Timestamp time_{ 0 };
 };
 
 //There can be more than one trade/more than one execution
 using Trades = std::vector<Trade>;
 
-class Orderbook
+enum class BandReference
 {
-private:
-    //When we store our orders, we think of maps and unordered maps
-    //Map represents bids and asks. Bids are sorted in descending order. Asks are sorted in ascendign order
-    //Specify an actual order
-    //Also need easy O(1) access for an order based on its orderId
-    struct OrderEntry
-    {
-        OrderPointer order_{ nullptr };
-        OrderPointers::iterator location_;
-    };
+    LastTrade,
+    RollingVwap
+};
 
-    std::map<Price, OrderPointers, std::greater<Price>> bids_;
-    std::map<Price, OrderPointers, std::less<Price>> asks_;
-    std::unordered_map<OrderId, OrderEntry> orders_;
+enum class BandBreachAction
+{
+    Reject, //Aggressor's remaining quantity is cancelled
+    Halt //Book switches to auction, aggressor rests until Uncross
+};
 
-    //Non FAK, match the order to the order book
-    bool CanMatch(Side side, Price price) const //Just need side and price. Const means not mutating anything
-    {
-        if (side == Side::Buy)
-        {
-            if (asks_.empty()) //if no asks, cannot match
-                return false;
+struct PriceBandConfig
+{
+    BandReference reference_{ BandReference::LastTrade };
+    std::uint32_t widthBasisPoints_{ 500 }; //Allowed distance either side of the reference, 500 = 5%
+    BandBreachAction action_{ BandBreachAction::Halt };
+    std::size_t vwapTrades_{ 100 }; //Rolling VWAP window, in trades
+    std::optional<Price> initialReference_; //Without one the band stays open until the first trade
+};
 
-            const auto& [bestAsk, _] = *asks_.begin(); //Get best ask price
-            return price >= bestAsk; //Can match if buy price is greater than or equal to best ask price
-        }
-        else
-        {
-            if (bids_.empty()) //if no bids, cannot match
-                return false;
-            const auto& [bestBid, _] = *bids_.begin(); //Get best bid price
-            return price <= bestBid; //Can match if sell price is less than or equal to best bid price
-        }
-        
+//Dynamic band around a reference price. Reference moves with every trade in O(1):
+//last price, or a rolling VWAP kept as running sums over a ring of the most recent trades
+class PriceBand
+{
+public:
+    explicit PriceBand(const PriceBandConfig& config)
+    : config_{ config }
+    , window_(std::max<std::size_t>(config.vwapTrades_, 1))
+    , reference_{ config.initialReference_ }
+    { }
+
+    const PriceBandConfig& GetConfig() const { return config_; }
+    std::optional<Price> GetReference() const { return reference_; }
+
+    bool Allows(Price price) const
+    {
+        if (!reference_)
+            return true;
+        const std::int64_t distance = std::abs(static_cast<std::int64_t>(price) - *reference_);
+        return distance * 10'000 <= std::abs(static_cast<std::int64_t>(*reference_)) * config_.widthBasisPoints_;
     }
 
-    //Match function. Have orders in the order book that need to be resolved
-    //Return trades that happened as a result of matching
-    Trades MatchOrders()
+    void OnTrade(Price price, Quantity quantity)
     {
-        Trades trades;
-        trades.reserve(orders_.size());
-        while(true)
+        if (config_.reference_ == BandReference::LastTrade)
         {
-            if(bids_.empty() || asks_.empty()) //if no bids or asks we will break
-                break;
-
-            auto& [bidPrice, bids] = *bids_.begin();
-            auto& [askPrice, asks] = *asks_.begin();
+            reference_ = price;
+            return;
+        }
 
-            if (bidPrice < askPrice) //No more matches possible
-                break;
+        auto& oldest = window_[next_];
+        notional_ += static_cast<std::int64_t>(price) * quantity - oldest.notional_;
+        quantity_ += std::int64_t{ quantity } - oldest.quantity_;
+        oldest = WindowEntry{ static_cast<std::int64_t>(price) * quantity, quantity };
+        next_ = next_ + 1 == window_.size() ? 0 : next_ + 1;
+        if (quantity_ > 0)
+            reference_ = static_cast<Price>((notional_ + (notional_ >= 0 ? quantity_ / 2 : -quantity_ / 2)) / quantity_); //Rounded to nearest
+    }
 
-            while (bids.size() && asks.size())
-            {
-                auto& bid = bids.front(); //time price priority
-                auto& ask = asks.front();
+private:
+    struct WindowEntry
+    {
+        std::int64_t notional_{ 0 };
+        std::int64_t quantity_{ 0 };
+    };
 
-                Quantity quantity = std::min(bid->GetRemainingQuantity(), ask->GetRemainingQuantity());
-                bid->Fill(quantity);
-                ask->Fill(quantity);
+    PriceBandConfig config_;
+    std::vector<WindowEntry> window_;
+    std::size_t next_{ 0 };
+    std::int64_t notional_{ 0 };
+    std::int64_t quantity_{ 0 };
+    std::optional<Price> reference_;
+};
 
-                if (bid->isFilled())
-                {
-                    bids.pop_front(); //dont need in queue anymore
-                    orders_.erase(bid->GetOrderId()); // dont need in orders either
-                }
+//One bar of the trade tape. Bars with no trades in them are never opened
+struct TradeBar
+{
+    Timestamp start_{ 0 };
+    Price open_{ 0 };
+    Price high_{ 0 };
+    Price low_{ 0 };
+    Price close_{ 0 };
+    std::uint64_t volume_{ 0 };
+    double notional_{ 0 };
+    std::uint32_t trades_{ 0 };
 
-                if (ask->isFilled())
-                {
-                    asks.pop_front();
-                    orders_.erase(ask->GetOrderId());
-                }
+    double GetVwap() const { return volume_ == 0 ? std::numeric_limits<double>::quiet_NaN() : notional_ / volume_; }
+};
 
-                //What if we have no bids or asks remaining in this price level
-                if (bids.empty())
-                    bids_.erase(bidPrice);
-                if (asks.empty())
-                    asks_.erase(askPrice);
-                //Execute a trade
-                trades.push_back(Trade{ 
-                    TradeInfo{ bid->GetOrderId(), bid->GetPrice(), quantity },
-                    TradeInfo{ ask->GetOrderId(), ask->GetPrice(), quantity }
-                });
-            }
-        }
+//Executions kept column by column in fixed size rings, oldest overwritten first. Bars for every configured interval roll
+//forward as trades are recorded, so the current bar and the last barHistory closed ones are read without rescanning trades
+class TradeTape
+{
+public:
+    static constexpr std::uint8_t NoAggressor = 2; //Auction prints
 
-        //If FOK order, and it hasn't been fully filled, its still gonna be in order book and we need to remove it
-        if (!bids_.empty())
-        {
-            auto& [_, bids] = *bids_.begin();
-            auto& order = bids.front();
-            if (order->GetOrderType() == OrderType::FillandKill)
-                CancelOrder(order->GetOrderId());
-        }
-        if (!asks_.empty())
+    TradeTape(std::size_t capacity, const std::vector<Timestamp>& barIntervals, std::size_t barHistory = 64)
+    : capacity_{ capacity }
+    , times_(capacity)
+    , prices_(capacity)
+    , quantities_(capacity)
+    , aggressors_(capacity)
+    , buyOrderIds_(capacity)
+    , sellOrderIds_(capacity)
+    , barHistory_{ barHistory }
+    {
+        if (capacity == 0 || barHistory == 0)
+            throw std::logic_error("Tape needs room for at least one trade and one bar");
+        for (Timestamp interval : barIntervals)
         {
-            auto& [_, asks] = *asks_.begin();
-            auto& order = asks.front();
-            if (order->GetOrderType() == OrderType::FillandKill)
-                CancelOrder(order->GetOrderId());
+            if (interval == 0)
+                throw std::logic_error("Bar interval must be positive");
+            series_.push_back(BarSeries{ interval, std::nullopt, std::vector<TradeBar>(barHistory), 0 });
         }
-
-        return trades;
     }
 
-public:
+    void Record(Timestamp time, Price price, Quantity quantity, std::optional<Side> aggressor, OrderId buyOrderId, OrderId sellOrderId)
+    {
+        const std::size_t slot = recorded_++ % capacity_;
+        times_[slot] = time;
+        prices_[slot] = price;
+        quantities_[slot] = quantity;
+        aggressors_[slot] = aggressor ? static_cast<std::uint8_t>(*aggressor) : NoAggressor;
+        buyOrderIds_[slot] = buyOrderId;
+        sellOrderIds_[slot] = sellOrderId;
 
-    //Everytime you add an oder you can match, return trades if any
-    Trades AddOrder(OrderPointer order) //non const because you can mutate this
-    { 
-        if (orders_.find(order->GetOrderId()) != orders_.end())
-            return { }; //Order already exists, cannot add again
-        if (order->GetOrderType() == OrderType::FillandKill && !CanMatch(order->GetSide(), order->GetPrice()))
-            return { }; //Cannot match FAK order, so we dont add it
+        for (BarSeries& series : series_)
+        {
+            const Timestamp start = time - time % series.interval_;
+            if (series.current_ && series.current_->start_ != start)
+                series.closed_[series.closedCount_++ % barHistory_] = *series.current_;
+            if (!series.current_ || series.current_->start_ != start)
+                series.current_ = TradeBar{ start, price, price, price, price, 0, 0, 0 };
+            TradeBar& bar = *series.current_;
+            bar.high_ = std::max(bar.high_, price);
+            bar.low_ = std::min(bar.low_, price);
+            bar.close_ = price;
+            bar.volume_ += quantity;
+            bar.notional_ += static_cast<double>(price) * quantity;
+            ++bar.trades_;
+        }
+    }
 
-        OrderPointers::iterator iterator;
+    std::size_t Size() const { return std::min<std::uint64_t>(recorded_, capacity_); }
+    std::uint64_t GetRecordedCount() const { return recorded_; } //Including those overwritten
 
-        if (order->GetSide() == Side::Buy)
-        { 
-            auto& orders = bids_[order->GetPrice()];
-            orders.push_back(order);
-            iterator = std::next(orders.begin(), orders.size() - 1); //Get iterator to the last element we just added
-        }
-        else
-        { 
-            auto& orders = asks_[order->GetPrice()];
-            orders.push_back(order);
-            iterator = std::next(orders.begin(), orders.size() - 1); //Get iterator to the last element we just added
-        }
+    //Columns of the index-th trade still held, 0 being the oldest
+    Timestamp GetTime(std::size_t index) const { return times_[Slot(index)]; }
+    Price GetPrice(std::size_t index) const { return prices_[Slot(index)]; }
+    Quantity GetQuantity(std::size_t index) const { return quantities_[Slot(index)]; }
+    std::uint8_t GetAggressor(std::size_t index) const { return aggressors_[Slot(index)]; }
+    OrderId GetBuyOrderId(std::size_t index) const { return buyOrderIds_[Slot(index)]; }
+    OrderId GetSellOrderId(std::size_t index) const { return sellOrderIds_[Slot(index)]; }
 
-        orders_.insert({ order->GetOrderId(), OrderEntry{ order, iterator } });
-        return MatchOrders();
+    std::size_t GetIntervalCount() const { return series_.size(); }
+    //Bar still being built for an interval. nullopt before its first trade
+    const std::optional<TradeBar>& GetCurrentBar(std::size_t interval) const { return series_.at(interval).current_; }
+    //back = 1 is the last closed bar. nullopt once back goes past what has closed or past barHistory
+    std::optional<TradeBar> GetClosedBar(std::size_t interval, std::size_t back) const
+    {
+        const BarSeries& series = series_.at(interval);
+        if (back == 0 || back > std::min<std::uint64_t>(series.closedCount_, barHistory_))
+            return std::nullopt;
+        return series.closed_[(series.closedCount_ - back) % barHistory_];
     }
 
-    //Now we do cancel first. Modify is just a cancel and a replace. So need cancel
+    //Columnar binary file, oldest trade first: "TAPE", format version, trade count, then each column back to back
+    //(time u64, price i64, quantity u32, aggressor u8, buy id u64, sell id u64), native byte order
+    bool Dump(const std::string& path) const
+    {
+        std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+        const std::uint32_t version = 1;
+        const std::uint64_t count = Size();
+        file.write("TAPE", 4);
+        Write(file, version);
+        Write(file, count);
+        WriteColumn(file, times_, [](Timestamp time) { return time; });
+        WriteColumn(file, prices_, [](Price price) { return static_cast<std::int64_t>(price); });
+        WriteColumn(file, quantities_, [](Quantity quantity) { return quantity; });
+        WriteColumn(file, aggressors_, [](std::uint8_t aggressor) { return aggressor; });
+        WriteColumn(file, buyOrderIds_, [](OrderId orderId) { return orderId; });
+        WriteColumn(file, sellOrderIds_, [](OrderId orderId) { return orderId; });
+        return static_cast<bool>(file);
+    }
 
-    void CancelOrder(OrderId orderId) 
+private:
+    struct BarSeries
     {
-        if (orders_.find(orderId) == orders_.end())
-            return; //Order does not exist, nothing to cancel
+        Timestamp interval_;
+        std::optional<TradeBar> current_;
+        std::vector<TradeBar> closed_; //Ring of the last barHistory closed bars
+        std::uint64_t closedCount_;
+    };
 
-        const auto& [order, orderIterator] = orders_.at(orderId);
-        
-        if (order->GetSide() == Side::Sell)
-        { 
-            auto price = order->GetPrice();
-            auto& orderPointers = asks_.at(price);
-            orderPointers.erase(orderIterator); //Remove from order pointers list
-            if (orderPointers.empty())
-                asks_.erase(price); //If no more orders at this price level, remove the price level
-        }
-        else
-        {
-            auto price = order->GetPrice();
-            auto& orders = bids_.at(price);
-            orders.erase(orderIterator);
-            if (orders.empty())
-                bids_.erase(price);
-        }
+    std::size_t Slot(std::size_t index) const { return (recorded_ - Size() + index) % capacity_; }
 
-        orders_.erase(orderId); //Remove from orders map AFTER using the references
+    template <typename Value>
+    static void Write(std::ofstream& file, const Value& value) { file.write(reinterpret_cast<const char*>(&value), sizeof(value)); }
+
+    //Column in time order, converted to its file width. Written in chunks so a long column is not copied whole
+    template <typename Column, typename Convert>
+    void WriteColumn(std::ofstream& file, const Column& column, Convert convert) const
+    {
+        using Stored = decltype(convert(column[0]));
+        std::array<Stored, 1024> chunk;
+        const std::size_t count = Size();
+        for (std::size_t index = 0; index < count; )
+        {
+            std::size_t filled = 0;
+            for (; filled < chunk.size() && index < count; ++filled, ++index)
+                chunk[filled] = convert(column[Slot(index)]);
+            file.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(filled * sizeof(Stored)));
+        }
+    }
+
+    std::size_t capacity_;
+    std::uint64_t recorded_{ 0 };
+    std::vector<Timestamp> times_;
+    std::vector<Price> prices_;
+    std::vector<Quantity> quantities_;
+    std::vector<std::uint8_t> aggressors_; //Side, or NoAggressor
+    std::vector<OrderId> buyOrderIds_;
+    std::vector<OrderId> sellOrderIds_;
+    std::size_t barHistory_;
+    std::vector<BarSeries> series_;
+};
+
+//Outcome of an auction if it uncrossed right now
+struct AuctionResult
+{
+    Price price_;
+    std::uint64_t volume_; //Executable at price_
+    std::int64_t imbalance_; //Bid depth minus ask depth at price_. Positive means buy pressure is left over
+};
+
+//Callbacks for what happens on the book. Everything defaults to a no-op so a listener only overrides what it cares about
+class OrderbookListener
+{
+public:
+    virtual ~OrderbookListener() = default;
+
+    //Order accepted into the book (ack). Fires before it gets a chance to match
+    virtual void OnOrderAdded(const Order& /*order*/) { }
+    //Order traded quantity at price. Order already reflects the fill
+    virtual void OnOrderFilled(const Order& /*order*/, Price /*price*/, Quantity /*quantity*/) { }
+    //Quantity taken off without a trade (self-trade decrement)
+    virtual void OnOrderDecremented(const Order& /*order*/, Quantity /*quantity*/) { }
+    virtual void OnOrderCancelled(const Order& /*order*/) { }
+    //Auction started or ended, including a halt from a price band breach
+    virtual void OnTradingPhaseChanged(TradingPhase /*phase*/) { }
+    //Whole level removed at once (mass cancel, session end). One event per level, the orders are still there to look at
+    virtual void OnLevelDeleted(Side /*side*/, Price /*price*/, const PriceLevel& /*level*/) { }
+};
+
+//Hierarchical timing wheel for GTD expiries. 4 levels of 256 slots, every level is 256x coarser than the one below
+//Order sits in the finest level that can still hold its distance and moves down a level each time the level below wraps (cascade)
+//Advancing only visits occupied slots, so expiring costs O(expired) plus one cascade per 256 ticks crossed
+class ExpiryWheel
+{
+public:
+    explicit ExpiryWheel(Timestamp resolution = 1'000'000) //1ms ticks cover ~49 days before the overflow list is needed
+    : resolution_{ resolution }
+    { }
+
+    ExpiryWheel(const ExpiryWheel&) = delete;
+    ExpiryWheel& operator=(const ExpiryWheel&) = delete;
+
+    std::size_t Size() const { return count_; }
+
+    //Expiry is rounded up to a tick, so an order is never expired early. It can be up to one tick late
+    void Schedule(Order& order)
+    {
+        Insert(order, (order.GetExpiry() + resolution_ - 1) / resolution_);
+        ++count_;
+    }
+
+    void Cancel(Order& order)
+    {
+        if (!order.GetExpiryHook().IsLinked())
+            return;
+        order.GetExpiryHook().Unlink(); //Occupancy bit can go stale, a stale bit just costs one empty slot visit
+        --count_;
+    }
+
+    //Moves the wheel up to now and appends every order that is due
+    void Advance(Timestamp now, OrderIds& expired)
+    {
+        const std::uint64_t target = now / resolution_;
+        while (currentTick_ < target)
+        {
+            if (count_ == 0) //Nothing scheduled, nothing to cascade either
+            {
+                currentTick_ = target;
+                break;
+            }
+
+            const std::uint64_t base = currentTick_ & ~SlotMask;
+            const int slot = NextOccupied(0, (currentTick_ & SlotMask) + 1);
+            if (slot < Slots && base + slot <= target)
+            {
+                currentTick_ = base + slot;
+                Fire(slot, expired);
+                continue;
+            }
+
+            //Nothing left in this rotation. Jump straight to the next rotation start where a cascade has something to hand down
+            const std::uint64_t boundary = NextCascade();
+            if (boundary > target)
+            {
+                currentTick_ = target;
+                break;
+            }
+            currentTick_ = boundary;
+            Cascade();
+            Fire(0, expired);
+        }
+    }
+
+private:
+    static constexpr int Levels = 4;
+    static constexpr int SlotBits = 8;
+    static constexpr int Slots = 1 << SlotBits;
+    static constexpr std::uint64_t SlotMask = Slots - 1;
+
+    void Insert(Order& order, std::uint64_t tick)
+    {
+        const std::uint64_t distance = tick > currentTick_ ? tick - currentTick_ : 0;
+        int level = 0;
+        while (level < Levels && distance >= (std::uint64_t{ 1 } << (SlotBits * (level + 1))))
+            ++level;
+
+        if (level == Levels)
+        {
+            overflow_.PushBack(order, order.GetExpiryHook());
+            return;
+        }
+        const auto slot = static_cast<int>((tick >> (SlotBits * level)) & SlotMask);
+        slots_[level][slot].PushBack(order, order.GetExpiryHook());
+        occupied_[level][slot / 64] |= std::uint64_t{ 1 } << (slot % 64);
+    }
+
+    //First occupied slot at or after from, Slots if none
+    int NextOccupied(int level, int from) const
+    {
+        for (int word = from / 64; word < Slots / 64; ++word)
+        {
+            std::uint64_t bits = occupied_[level][word];
+            if (word == from / 64)
+                bits &= ~std::uint64_t{ 0 } << (from % 64);
+            if (bits)
+                return word * 64 + std::countr_zero(bits);
+        }
+        return Slots;
+    }
+
+    //Earliest level 0 rotation start at which anything can come due. Empty rotations in between are skipped entirely
+    std::uint64_t NextCascade() const
+    {
+        auto LevelSpan = [](int level) { return std::uint64_t{ 1 } << (SlotBits * level); };
+        auto HasAny = [this](int level) { return std::any_of(occupied_[level].begin(), occupied_[level].end(), [](std::uint64_t bits) { return bits != 0; }); };
+
+        std::uint64_t boundary = std::numeric_limits<std::uint64_t>::max();
+        if (HasAny(0)) //Wrapped slots belong to the next rotation
+            boundary = (currentTick_ & ~SlotMask) + Slots;
+        for (int level = 1; level < Levels; ++level)
+        {
+            const std::uint64_t rotationStart = currentTick_ & ~(LevelSpan(level + 1) - 1);
+            const auto index = static_cast<int>((currentTick_ >> (SlotBits * level)) & SlotMask);
+            const int slot = NextOccupied(level, index + 1);
+            if (slot < Slots)
+                boundary = std::min(boundary, rotationStart + slot * LevelSpan(level));
+            else if (HasAny(level))
+                boundary = std::min(boundary, rotationStart + LevelSpan(level + 1));
+        }
+        if (!overflow_.empty())
+            boundary = std::min(boundary, (currentTick_ & ~(LevelSpan(Levels) - 1)) + LevelSpan(Levels));
+        return boundary;
+    }
+
+    void Fire(int slot, OrderIds& expired)
+    {
+        auto& entries = slots_[0][slot];
+        while (!entries.empty())
+        {
+            expired.push_back(entries.PopFront().GetOrderId());
+            --count_;
+        }
+        occupied_[0][slot / 64] &= ~(std::uint64_t{ 1 } << (slot % 64));
+    }
+
+    //We just reached the start of a level 0 rotation. Every higher level whose rotation also starts here hands its current slot down, coarsest first
+    void Cascade()
+    {
+        int top = 1;
+        while (top < Levels && (currentTick_ & ((std::uint64_t{ 1 } << (SlotBits * (top + 1))) - 1)) == 0)
+            ++top;
+
+        if (top == Levels) //Whole wheel wrapped, overflow gets another chance to fit
+            Requeue(overflow_);
+        for (int level = std::min(top, Levels - 1); level >= 1; --level)
+        {
+            const auto slot = static_cast<int>((currentTick_ >> (SlotBits * level)) & SlotMask);
+            occupied_[level][slot / 64] &= ~(std::uint64_t{ 1 } << (slot % 64));
+            Requeue(slots_[level][slot]);
+        }
+    }
+
+    void Requeue(OrderHookList& entries)
+    {
+        OrderHookList pending;
+        pending.Splice(entries);
+        while (!pending.empty())
+        {
+            Order& order = pending.PopFront();
+            Insert(order, (order.GetExpiry() + resolution_ - 1) / resolution_);
+        }
+    }
+
+    Timestamp resolution_;
+    std::uint64_t currentTick_{ 0 };
+    std::size_t count_{ 0 };
+    std::array<std::array<OrderHookList, Slots>, Levels> slots_;
+    std::array<std::array<std::uint64_t, Slots / 64>, Levels> occupied_{ };
+    OrderHookList overflow_;
+};
+
+enum class TrailingOffsetType : std::uint8_t
+{
+    Fixed, //Price units
+    Percentage //Basis points of the watermark
+};
+
+//How far a trailing stop trails its watermark
+struct TrailingOffset
+{
+    TrailingOffsetType type_{ TrailingOffsetType::Fixed };
+    std::uint32_t amount_{ 0 };
+
+    auto operator<=>(const TrailingOffset&) const = default;
+};
+
+//Trailing stops wait off book until the last trade moves their offset away from the best print since they came in (the watermark)
+//Sell stops trail the high, buy stops the low. Triggered orders are handed back to be added
+//Stops with the same offset share a group, bucketed by watermark. A print merges every bucket it passes into one, which is the only
+//watermark update, so a trade costs one merge per group however many stops rest. Triggered buckets come off the far end
+//Waiting order is not in the book, so its expiry hook is free to link it into a bucket
+class TrailingStops
+{
+public:
+    TrailingStops() = default;
+    TrailingStops(const TrailingStops&) = delete;
+    TrailingStops& operator=(const TrailingStops&) = delete;
+
+    bool IsEmpty() const { return stops_.empty(); }
+    std::size_t Size() const { return stops_.size(); }
+
+    //Watermark starts at the last trade. False if the id is already waiting
+    bool Add(const OrderPointer& order, TrailingOffset offset, Price lastTrade)
+    {
+        if (!stops_.emplace(order->GetOrderId(), order).second)
+            return false;
+        auto& groups = order->GetSide() == Side::Sell ? sellGroups_ : buyGroups_;
+        groups[offset][lastTrade].PushBack(*order, order->GetExpiryHook());
+        return true;
+    }
+
+    bool Cancel(OrderId orderId)
+    {
+        auto stop = stops_.find(orderId);
+        if (stop == stops_.end())
+            return false;
+        stop->second->GetExpiryHook().Unlink(); //Empty bucket is dropped by the next merge or trigger that reaches it
+        stops_.erase(stop);
+        return true;
+    }
+
+    //One print. Triggered orders are appended sell groups first, then buy groups, each by offset, then watermark, then arrival
+    void OnTrade(Price price, std::vector<OrderPointer>& triggered)
+    {
+        for (auto& [offset, buckets] : sellGroups_)
+        {
+            Raise(buckets, price);
+            while (!buckets.empty() && Trigger(Side::Sell, offset, std::prev(buckets.end())->first) >= price)
+                Release(buckets, std::prev(buckets.end()), triggered);
+        }
+        for (auto& [offset, buckets] : buyGroups_)
+        {
+            Lower(buckets, price);
+            while (!buckets.empty() && Trigger(Side::Buy, offset, buckets.begin()->first) <= price)
+                Release(buckets, buckets.begin(), triggered);
+        }
+        std::erase_if(sellGroups_, [](const auto& group) { return group.second.empty(); });
+        std::erase_if(buyGroups_, [](const auto& group) { return group.second.empty(); });
+    }
+
+private:
+    using Buckets = std::map<Price, OrderHookList>;
+
+    static Price Trigger(Side side, TrailingOffset offset, Price watermark)
+    {
+        const std::int64_t distance = offset.type_ == TrailingOffsetType::Fixed
+            ? std::int64_t{ offset.amount_ }
+            : (std::abs(std::int64_t{ watermark }) * offset.amount_ + 5'000) / 10'000;
+        return static_cast<Price>(side == Side::Sell ? watermark - distance : watermark + distance);
+    }
+
+    //Print above some sell watermarks. Those buckets all have the print as their watermark now
+    static void Raise(Buckets& buckets, Price price)
+    {
+        if (buckets.empty() || buckets.begin()->first >= price)
+            return;
+        auto& target = buckets[price];
+        for (auto bucket = buckets.begin(); bucket->first < price; )
+        {
+            target.Splice(bucket->second);
+            bucket = buckets.erase(bucket);
+        }
+    }
+
+    static void Lower(Buckets& buckets, Price price)
+    {
+        if (buckets.empty() || std::prev(buckets.end())->first <= price)
+            return;
+        auto& target = buckets[price];
+        for (auto bucket = buckets.upper_bound(price); bucket != buckets.end(); )
+        {
+            target.Splice(bucket->second);
+            bucket = buckets.erase(bucket);
+        }
+    }
+
+    void Release(Buckets& buckets, Buckets::iterator bucket, std::vector<OrderPointer>& triggered)
+    {
+        while (!bucket->second.empty())
+        {
+            auto stop = stops_.find(bucket->second.PopFront().GetOrderId());
+            triggered.push_back(std::move(stop->second));
+            stops_.erase(stop);
+        }
+        buckets.erase(bucket);
+    }
+
+    std::map<TrailingOffset, Buckets> sellGroups_;
+    std::map<TrailingOffset, Buckets> buyGroups_;
+    std::unordered_map<OrderId, OrderPointer> stops_; //Owns the waiting orders
+};
+
+//Allocation policies decide how an incoming order is shared among the resting orders of the level it hits
+//FIFO keeps the plain front-vs-front loop inside the book. The others fill in per-order allocations over a contiguous array of visible quantities
+struct FifoAllocation
+{
+    static constexpr bool TimePriorityOnly = true;
+};
+
+//Each resting order gets incoming * its size / level size, rounded down. Whatever rounding leaves over goes one lot at a time in time priority
+//Share is a 32.32 fixed point ratio so the main loop is a plain multiply and shift (vectorizes, no division per order) and never over-allocates
+inline void AllocateProRata(const Quantity* resting, std::size_t count, Quantity incoming, Quantity* allocations)
+{
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < count; ++i)
+        total += resting[i];
+
+    if (total <= incoming)
+    {
+        std::copy(resting, resting + count, allocations); //Whole level goes
+        return;
+    }
+
+    const std::uint64_t ratio = (std::uint64_t{ incoming } << 32) / total;
+    std::uint64_t allocated = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        allocations[i] = static_cast<Quantity>((std::uint64_t{ resting[i] } * ratio) >> 32);
+        allocated += allocations[i];
+    }
+
+    std::uint64_t remainder = incoming - allocated;
+    while (remainder)
+    {
+        for (std::size_t i = 0; i < count && remainder; ++i)
+        {
+            if (allocations[i] < resting[i])
+            {
+                ++allocations[i];
+                --remainder;
+            }
+        }
+    }
+}
+
+struct ProRataAllocation
+{
+    static constexpr bool TimePriorityOnly = false;
+
+    static void Allocate(const Quantity* resting, std::size_t count, Quantity incoming, Quantity* allocations)
+    {
+        AllocateProRata(resting, count, incoming, allocations);
+    }
+};
+
+//Hybrid. Order at the front of the level (top order) is filled first, the rest of the level shares what is left pro-rata
+struct TopOrderProRataAllocation
+{
+    static constexpr bool TimePriorityOnly = false;
+
+    static void Allocate(const Quantity* resting, std::size_t count, Quantity incoming, Quantity* allocations)
+    {
+        allocations[0] = std::min(resting[0], incoming);
+        AllocateProRata(resting + 1, count - 1, incoming - allocations[0], allocations + 1);
+    }
+};
+
+//Displayed depth of one side laid out flat, best level first, for queries that sweep many levels without touching orders
+//Keys are prices signed so that further from the touch is always larger (bids are stored negated). Doubles hold every
+//price and quantity exactly and let four levels go through one AVX2 register
+struct DepthLadder
+{
+    std::vector<double> keys_;
+    std::vector<double> quantities_;
+};
+
+struct LadderSweep
+{
+    double quantity_{ 0 }; //The target, or less if the ladder ran out
+    double notional_{ 0 }; //Sum of key * quantity taken
+    std::size_t levels_{ 0 }; //Levels touched, the last one possibly in part
+};
+
+#if defined(__AVX2__)
+//[a, b, c, d] -> [a, a+b, a+b+c, a+b+c+d] in two shift-and-add steps
+inline __m256d PrefixSum(__m256d values)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    values = _mm256_add_pd(values, _mm256_blend_pd(_mm256_permute4x64_pd(values, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0b0001));
+    return _mm256_add_pd(values, _mm256_blend_pd(_mm256_permute4x64_pd(values, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0b0011));
+}
+
+inline double HorizontalSum(__m256d values)
+{
+    const __m128d pairs = _mm_add_pd(_mm256_castpd256_pd128(values), _mm256_extractf128_pd(values, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+}
+#endif
+
+//Take levels front to back until target quantity. Whole blocks of four go through a prefix sum while the block stays under
+//the target, the block the target lands in (and anything without AVX2) finishes one level at a time
+inline LadderSweep SweepLadder(const double* keys, const double* quantities, std::size_t count, double target)
+{
+    LadderSweep sweep;
+    std::size_t level = 0;
+#if defined(__AVX2__)
+    const __m256d limit = _mm256_set1_pd(target);
+    __m256d taken = _mm256_setzero_pd(); //Broadcast of everything taken before this block
+    __m256d notional = _mm256_setzero_pd();
+    for (; level + 4 <= count; level += 4)
+    {
+        const __m256d block = _mm256_loadu_pd(quantities + level);
+        const __m256d cumulative = _mm256_add_pd(PrefixSum(block), taken);
+        if (_mm256_movemask_pd(_mm256_cmp_pd(cumulative, limit, _CMP_GE_OQ)) != 0)
+            break;
+        notional = _mm256_add_pd(notional, _mm256_mul_pd(_mm256_loadu_pd(keys + level), block));
+        taken = _mm256_permute4x64_pd(cumulative, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    sweep.quantity_ = _mm256_cvtsd_f64(taken);
+    sweep.notional_ = HorizontalSum(notional);
+#endif
+    for (; level < count && sweep.quantity_ < target; ++level)
+    {
+        const double quantity = std::min(quantities[level], target - sweep.quantity_);
+        sweep.quantity_ += quantity;
+        sweep.notional_ += keys[level] * quantity;
+    }
+    sweep.levels_ = level;
+    return sweep;
+}
+
+//Quantity on the levels with key <= limit. Keys ascend, so the first block that reaches past the limit is the last one
+inline double SumLadderWithin(const double* keys, const double* quantities, std::size_t count, double limit)
+{
+    double total = 0;
+    std::size_t level = 0;
+#if defined(__AVX2__)
+    const __m256d bound = _mm256_set1_pd(limit);
+    __m256d sum = _mm256_setzero_pd();
+    for (; level + 4 <= count; level += 4)
+    {
+        const __m256d inside = _mm256_cmp_pd(_mm256_loadu_pd(keys + level), bound, _CMP_LE_OQ);
+        sum = _mm256_add_pd(sum, _mm256_and_pd(inside, _mm256_loadu_pd(quantities + level)));
+        if (_mm256_movemask_pd(inside) != 0b1111)
+        {
+            level = count;
+            break;
+        }
+    }
+    total = HorizontalSum(sum);
+#endif
+    for (; level < count && keys[level] <= limit; ++level)
+        total += quantities[level];
+    return total;
+}
+
+//What an aggressive order would get from displayed depth right now
+struct FillEstimate
+{
+    Quantity quantity_{ 0 }; //Less than asked if the displayed depth (or the ladder) runs out
+    double averagePrice_{ std::numeric_limits<double>::quiet_NaN() };
+    std::optional<Price> worstPrice_; //Last level it would reach
+    std::size_t levels_{ 0 };
+};
+
+//Single writer, any number of readers, and readers never hold the writer up. A reader copies and retries if a write
+//started or finished meanwhile. The value is kept as relaxed atomic words so the racing copy is well defined
+template <typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    void Store(const T& value)
+    {
+        std::array<std::uint64_t, Words> words{ };
+        std::memcpy(words.data(), &value, sizeof(T));
+        const std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed); //Odd while writing
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t word = 0; word < Words; ++word)
+            words_[word].store(words[word], std::memory_order_relaxed);
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    T Load() const
+    {
+        std::array<std::uint64_t, Words> words;
+        std::uint64_t before = 0;
+        std::uint64_t after = 0;
+        do
+        {
+            before = sequence_.load(std::memory_order_acquire);
+            for (std::size_t word = 0; word < Words; ++word)
+                words[word] = words_[word].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence_.load(std::memory_order_relaxed);
+        } while (before != after || (before & 1) != 0);
+        T value;
+        std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T)); //Trivially copyable, not necessarily trivially constructible
+        return value;
+    }
+
+private:
+    static constexpr std::size_t Words = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+    alignas(64) std::atomic<std::uint64_t> sequence_{ 0 };
+    std::array<std::atomic<std::uint64_t>, Words> words_{ };
+};
+
+constexpr std::size_t DepthBandCount = 4;
+
+struct MarketSnapshotConfig
+{
+    std::size_t imbalanceLevels_{ 5 }; //Top K displayed levels per side that imbalance and the depth weighted mid look at
+    std::array<std::int64_t, DepthBandCount> depthTicks_{ 0, 2, 5, 10 }; //Cumulative depth within this many ticks of each side's best
+};
+
+//Top of book and what is derived from it, published for readers on other threads. Displayed quantity only, pegs not included
+struct MarketSnapshot
+{
+    std::uint64_t version_{ 0 }; //One per published command
+    std::optional<LevelInfo> bid_;
+    std::optional<LevelInfo> ask_;
+    double imbalance_{ 0 }; //(bid - ask) / (bid + ask) over the top K levels, 0 when both are empty
+    double microprice_{ std::numeric_limits<double>::quiet_NaN() }; //Touch prices weighted by the opposite touch size
+    double weightedMid_{ std::numeric_limits<double>::quiet_NaN() }; //Same with each side's top K VWAP and depth
+    std::array<Quantity, DepthBandCount> bidDepth_{ };
+    std::array<Quantity, DepthBandCount> askDepth_{ };
+};
+
+//Thread and memory placement. Topology is read from /sys once at startup, then a plan puts every matcher shard, its ingress
+//ring and its arena on one NUMA node so the hot path never crosses a socket
+
+//Prefer node for pages of [memory, memory + bytes) not faulted in yet. Only a preference, a full node still hands out
+//memory from another. False where the kernel has no NUMA support
+inline bool BindToNode(void* memory, std::size_t bytes, int node)
+{
+#if defined(__linux__)
+    if (node < 0 || node >= static_cast<int>(sizeof(unsigned long) * 8))
+        return false;
+    const unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, memory, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == 0;
+#else
+    (void)memory;
+    (void)bytes;
+    (void)node;
+    return false;
+#endif
+}
+
+//Pins the calling thread to one CPU. False if the process may not run there (taskset, cgroup cpuset)
+inline bool PinCurrentThread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+//One logical CPU. Hyperthreads of a physical core share core_ and package_
+struct LogicalCpu
+{
+    int cpu_;
+    int core_; //core_id, only unique within a package
+    int package_;
+    int node_; //0 on machines without NUMA
+};
+
+class CpuTopology
+{
+public:
+    //Reads online CPUs, their cores and packages, and each node's cpulist. Files that are missing (containers, other
+    //kernels) leave each CPU its own core on node 0, and with no /sys at all every online CPU is counted that way
+    static CpuTopology Discover(const std::string& root = "/sys/devices/system")
+    {
+        auto Read = [](const std::string& path)
+        {
+            std::ifstream file{ path };
+            std::string text;
+            std::getline(file, text);
+            return text;
+        };
+        auto ReadNumber = [&Read](const std::string& path, int fallback)
+        {
+            const std::string text = Read(path);
+            return text.empty() ? fallback : std::stoi(text);
+        };
+
+        std::unordered_map<int, int> nodes;
+        for (int node : ParseCpuList(Read(root + "/node/online")))
+            for (int cpu : ParseCpuList(Read(root + "/node/node" + std::to_string(node) + "/cpulist")))
+                nodes[cpu] = node;
+
+        CpuTopology topology;
+        for (int cpu : ParseCpuList(Read(root + "/cpu/online")))
+        {
+            const std::string path = root + "/cpu/cpu" + std::to_string(cpu) + "/topology/";
+            const auto node = nodes.find(cpu);
+            topology.cpus_.push_back(LogicalCpu{ cpu, ReadNumber(path + "core_id", cpu), ReadNumber(path + "physical_package_id", 0),
+                node == nodes.end() ? 0 : node->second });
+        }
+        if (topology.cpus_.empty())
+            for (int cpu = 0; cpu < static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)); ++cpu)
+                topology.cpus_.push_back(LogicalCpu{ cpu, cpu, 0, 0 });
+        return topology;
+    }
+
+    //"0-3,8,10-11" as in the cpulist files
+    static std::vector<int> ParseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::size_t position = 0;
+        while (position < list.size())
+        {
+            std::size_t end = list.find(',', position);
+            if (end == std::string::npos)
+                end = list.size();
+            const std::string range = list.substr(position, end - position);
+            const std::size_t dash = range.find('-');
+            if (!range.empty() && range.find_first_not_of("0123456789-\n ") == std::string::npos)
+            {
+                const int first = std::stoi(range.substr(0, dash));
+                const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+            position = end + 1;
+        }
+        return cpus;
+    }
+
+    //Drops the CPUs this process is not allowed to run on
+    void RestrictToAffinity()
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return;
+        std::erase_if(cpus_, [&set](const LogicalCpu& cpu) { return cpu.cpu_ >= CPU_SETSIZE || !CPU_ISSET(cpu.cpu_, &set); });
+#endif
+    }
+
+    const std::vector<LogicalCpu>& GetCpus() const { return cpus_; }
+
+    std::vector<int> GetNodes() const
+    {
+        std::vector<int> nodes;
+        for (const auto& cpu : cpus_)
+            nodes.push_back(cpu.node_);
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        return nodes;
+    }
+
+    //Physical cores of node in CPU order, each as its logical CPUs, lowest first
+    std::vector<std::vector<int>> GetCores(int node) const
+    {
+        std::map<std::pair<int, int>, std::vector<int>> byCore;
+        for (const auto& cpu : cpus_)
+            if (cpu.node_ == node)
+                byCore[{ cpu.package_, cpu.core_ }].push_back(cpu.cpu_);
+        std::vector<std::vector<int>> cores;
+        for (auto& [key, threads] : byCore)
+        {
+            std::sort(threads.begin(), threads.end());
+            cores.push_back(std::move(threads));
+        }
+        std::sort(cores.begin(), cores.end());
+        return cores;
+    }
+
+private:
+    std::vector<LogicalCpu> cpus_;
+};
+
+//Where one matcher shard runs. Its ingress ring and arena should be bound to node_ (SharedMemory and BookMemory take it)
+struct ShardPlacement
+{
+    int node_;
+    int matcherCpu_;
+    int gatewayCpu_;
+    int publisherCpu_;
+};
+
+//Shards go round robin over the nodes. Each matcher gets a physical core to itself while there are cores left. Gateway
+//and publisher go on a spare core of the same node (same L3, no socket hop), one on each hyperthread when it has two.
+//With no spare core they share the matcher core's sibling thread, and on a single CPU everything lands together
+inline std::vector<ShardPlacement> PlanShards(const CpuTopology& topology, std::size_t shards)
+{
+    std::vector<ShardPlacement> placements;
+    std::vector<std::pair<int, std::vector<std::vector<int>>>> nodes;
+    for (int node : topology.GetNodes())
+        if (auto cores = topology.GetCores(node); !cores.empty())
+            nodes.emplace_back(node, std::move(cores));
+    if (nodes.empty())
+        return placements;
+
+    for (std::size_t shard = 0; shard < shards; ++shard)
+    {
+        const auto& [node, cores] = nodes[shard % nodes.size()];
+        const std::size_t index = shard / nodes.size();
+        const std::size_t shardsOnNode = (shards - shard % nodes.size() + nodes.size() - 1) / nodes.size();
+        const std::size_t matcherCores = std::min(shardsOnNode, cores.size());
+        const auto& matcherCore = cores[index % cores.size()];
+
+        ShardPlacement placement{ node, matcherCore.front(), matcherCore.front(), matcherCore.front() };
+        if (const std::size_t spare = cores.size() - matcherCores; spare > 0)
+        {
+            const auto& helperCore = cores[matcherCores + index % spare];
+            placement.gatewayCpu_ = helperCore.front();
+            placement.publisherCpu_ = helperCore.back();
+        }
+        else if (matcherCore.size() > 1)
+        {
+            placement.gatewayCpu_ = matcherCore[1];
+            placement.publisherCpu_ = matcherCore.back();
+        }
+        placements.push_back(placement);
+    }
+    return placements;
+}
+
+//One block of memory for a book, on 2MB pages where the system has them: reserved huge pages first, then transparent huge
+//pages, then plain pages. Every page is touched up front so the book never takes a page fault on the hot path, and with a
+//node they are touched there. Hands memory out by bumping a pointer and never takes it back, BookMemory puts a pool in front to reuse freed blocks
+class HugePageArena : public std::pmr::memory_resource
+{
+public:
+    enum class Backing
+    {
+        HugePages,
+        TransparentHugePages,
+        Pages,
+    };
+
+    static constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
+
+    explicit HugePageArena(std::size_t bytes, std::optional<int> node = std::nullopt)
+    : capacity_{ std::max<std::size_t>(1, (bytes + HugePageSize - 1) / HugePageSize) * HugePageSize }
+    {
+        void* memory = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory == MAP_FAILED) //No huge pages reserved. Map a bit extra so the block can start on a 2MB boundary
+        {
+            memory = mmap(nullptr, capacity_ + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+                throw std::bad_alloc{ };
+            const auto address = reinterpret_cast<std::uintptr_t>(memory);
+            const auto aligned = (address + HugePageSize - 1) & ~(HugePageSize - 1);
+            if (aligned != address)
+                munmap(memory, aligned - address);
+            if (const auto tail = address + capacity_ + HugePageSize - (aligned + capacity_))
+                munmap(reinterpret_cast<void*>(aligned + capacity_), tail);
+            memory = reinterpret_cast<void*>(aligned);
+            backing_ = madvise(memory, capacity_, MADV_HUGEPAGE) == 0 ? Backing::TransparentHugePages : Backing::Pages;
+        }
+        base_ = static_cast<std::byte*>(memory);
+        if (node)
+            BindToNode(base_, capacity_, *node);
+        const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        for (std::size_t offset = 0; offset < capacity_; offset += pageSize)
+            base_[offset] = std::byte{ 0 };
+    }
+
+    ~HugePageArena() override { munmap(base_, capacity_); }
+
+    HugePageArena(const HugePageArena&) = delete;
+    HugePageArena& operator=(const HugePageArena&) = delete;
+
+    Backing GetBacking() const { return backing_; }
+    std::size_t GetCapacity() const { return capacity_; }
+    std::size_t GetUsed() const { return used_; }
+    //Bytes that did not fit and came from the heap instead
+    std::size_t GetOverflow() const { return overflow_; }
+
+private:
+    bool Contains(const void* pointer) const
+    {
+        const auto* byte = static_cast<const std::byte*>(pointer);
+        return byte >= base_ && byte < base_ + capacity_;
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        const std::size_t start = (used_ + alignment - 1) & ~(alignment - 1);
+        if (start + bytes > capacity_) [[unlikely]] //Full. Keep going off the heap rather than fail the book
+        {
+            overflow_ += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        used_ = start + bytes;
+        return base_ + start;
+    }
+
+    void do_deallocate(void* pointer, std::size_t bytes, std::size_t alignment) override
+    {
+        if (!Contains(pointer))
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    std::byte* base_{ nullptr };
+    std::size_t capacity_;
+    std::size_t used_{ 0 };
+    std::size_t overflow_{ 0 };
+    Backing backing_{ Backing::HugePages };
+};
+
+//What a book allocates from when it wants the arena: a pool over a HugePageArena, so freed nodes are reused in place
+//Not thread safe, one per book (or per matching thread). Has to outlive the book and every order it made
+class BookMemory
+{
+public:
+    explicit BookMemory(std::size_t bytes, std::optional<int> node = std::nullopt)
+    : arena_{ bytes, node }
+    , pool_{ &arena_ }
+    { }
+
+    std::pmr::memory_resource* GetResource() { return &pool_; }
+    const HugePageArena& GetArena() const { return arena_; }
+
+private:
+    HugePageArena arena_;
+    std::pmr::unsynchronized_pool_resource pool_;
+};
+
+template <typename AllocationPolicy>
+class BasicOrderbook
+{
+private:
+    //When we store our orders, we think of maps and unordered maps
+    //Map represents bids and asks. Bids are sorted in descending order. Asks are sorted in ascendign order
+    //Specify an actual order
+    //Also need easy O(1) access for an order based on its orderId
+    struct OrderEntry
+    {
+        OrderPointer order_{ nullptr };
+        OrderPointers::iterator location_;
+    };
+
+    //Pegged orders are kept per reference, keyed by offset. Within one reference a better offset is always a better price,
+    //so only the front of each map has to be priced and a touch move costs nothing
+    template <typename Compare>
+    using LevelMap = std::pmr::map<Price, PriceLevel, Compare>;
+    template <typename Compare>
+    using PegLevels = std::array<LevelMap<Compare>, 3>;
+
+    //Best prices the pegs are resolved against. With pegs on both sides, also each side's best peg as priced off the levels alone
+    struct Touch
+    {
+        std::optional<Price> bid_;
+        std::optional<Price> ask_;
+        std::optional<Price> bidPeg_;
+        std::optional<Price> askPeg_;
+    };
+
+    //Levels, queues and both indexes come from here. The default resource unless the book was given an arena
+    std::pmr::memory_resource* memory_;
+    LevelMap<std::greater<Price>> bids_;
+    LevelMap<std::less<Price>> asks_;
+    PegLevels<std::greater<Price>> bidPegs_;
+    PegLevels<std::less<Price>> askPegs_;
+    //All-or-none orders wait here, off the price levels, so they never hold up the orders behind them. Not displayed
+    LevelMap<std::greater<Price>> bidAllOrNone_;
+    LevelMap<std::less<Price>> askAllOrNone_;
+    std::pmr::unordered_map<OrderId, OrderEntry> orders_;
+    ExpiryWheel expiries_;
+    Timestamp now_{ 0 };
+    std::pmr::unordered_map<OwnerId, OrderHookList> owners_; //Every resting order of an owner, linked through the order itself
+    OrderbookListener* listener_{ nullptr };
+    TradingPhase phase_{ TradingPhase::Continuous };
+    SelfTradePrevention selfTradePrevention_{ SelfTradePrevention::None };
+    std::optional<PriceBand> priceBand_;
+    std::optional<TradeTape> tape_;
+    std::optional<Price> lastTradePrice_;
+    TrailingStops trailingStops_;
+    std::vector<OrderPointer> triggeredStops_; //Waiting to go in once the current match is done
+    bool releasingStops_{ false };
+    std::vector<Quantity> restingQuantities_; //Scratch for non FIFO allocation, reused so matching does not allocate
+    std::vector<Quantity> allocations_;
+    PriceSpec priceSpec_;
+    std::uint64_t checksum_{ 0 }; //Sum of StateHash over every resting order
+    std::optional<MarketSnapshotConfig> snapshotConfig_; //Set once someone wants snapshots
+    SeqLock<MarketSnapshot> snapshot_;
+    std::uint64_t snapshotVersion_{ 0 };
+    int commandDepth_{ 0 };
+    const TscClock* clock_{ nullptr };
+    Timestamp commandTime_{ 0 }; //Clock reading for the command being run
+    std::uint64_t eventSequence_{ 0 }; //Last sequence given to an order or a trade
+    std::array<DepthLadder, 2> ladders_; //Bids, asks. Rebuilt on the first depth query after a command
+    bool laddersStale_{ true };
+    std::size_t ladderDepth_{ 128 };
+
+    //Flat depth of the side an order on side would trade against
+    const DepthLadder& GetOppositeLadder(Side side)
+    {
+        if (laddersStale_)
+        {
+            auto Build = [this](const auto& levels, double sign, DepthLadder& ladder)
+            {
+                ladder.keys_.clear(); //Keeps capacity, a rebuild does not allocate once warmed up
+                ladder.quantities_.clear();
+                for (auto level = levels.begin(); level != levels.end() && ladder.keys_.size() < ladderDepth_; ++level)
+                {
+                    if (level->second.displayedQuantity_ == 0)
+                        continue;
+                    ladder.keys_.push_back(sign * level->first);
+                    ladder.quantities_.push_back(level->second.displayedQuantity_);
+                }
+            };
+            Build(bids_, -1.0, ladders_[0]);
+            Build(asks_, 1.0, ladders_[1]);
+            laddersStale_ = false;
+        }
+        return ladders_[side == Side::Buy ? 1 : 0];
+    }
+
+    //Public commands hold one of these. The outermost one reads the clock once on the way in, and publishes a snapshot on
+    //the way out, so a modify (cancel + add) or an add that releases stops is one command, stamped and published once
+    class CommandScope
+    {
+    public:
+        explicit CommandScope(BasicOrderbook& orderbook)
+        : orderbook_{ orderbook }
+        {
+            if (orderbook_.commandDepth_++ == 0 && orderbook_.clock_)
+                orderbook_.commandTime_ = orderbook_.clock_->Now();
+        }
+        ~CommandScope()
+        {
+            if (--orderbook_.commandDepth_ != 0)
+                return;
+            orderbook_.laddersStale_ = true;
+            if (orderbook_.snapshotConfig_) [[unlikely]]
+                orderbook_.PublishSnapshot();
+        }
+        CommandScope(const CommandScope&) = delete;
+        CommandScope& operator=(const CommandScope&) = delete;
+
+    private:
+        BasicOrderbook& orderbook_;
+    };
+
+    //Each side is walked as far as the top K levels or the widest depth band reach, whichever is further. Book depth beyond that is never touched
+    void PublishSnapshot()
+    {
+        const MarketSnapshotConfig& config = *snapshotConfig_;
+        const std::int64_t widestBand = *std::max_element(config.depthTicks_.begin(), config.depthTicks_.end());
+        struct SideSummary
+        {
+            std::optional<LevelInfo> best_;
+            double quantity_{ 0 }; //Top K
+            double notional_{ 0 };
+        };
+        auto Summarize = [this, &config, widestBand](const auto& levels, std::array<Quantity, DepthBandCount>& depth)
+        {
+            SideSummary summary;
+            std::size_t counted = 0;
+            for (const auto& [price, level] : levels)
+            {
+                const Quantity quantity = level.displayedQuantity_;
+                if (quantity == 0)
+                    continue;
+                if (!summary.best_)
+                    summary.best_ = LevelInfo{ price, quantity };
+                const std::int64_t distance = std::abs(priceSpec_.ToTicks(price) - priceSpec_.ToTicks(summary.best_->price_));
+                if (counted >= config.imbalanceLevels_ && distance > widestBand)
+                    break;
+                if (counted < config.imbalanceLevels_)
+                {
+                    ++counted;
+                    summary.quantity_ += quantity;
+                    summary.notional_ += static_cast<double>(price) * quantity;
+                }
+                for (std::size_t band = 0; band < DepthBandCount; ++band)
+                    if (distance <= config.depthTicks_[band])
+                        depth[band] += quantity;
+            }
+            return summary;
+        };
+
+        MarketSnapshot snapshot;
+        snapshot.version_ = ++snapshotVersion_;
+        const SideSummary bid = Summarize(bids_, snapshot.bidDepth_);
+        const SideSummary ask = Summarize(asks_, snapshot.askDepth_);
+        snapshot.bid_ = bid.best_;
+        snapshot.ask_ = ask.best_;
+        if (bid.quantity_ + ask.quantity_ > 0)
+            snapshot.imbalance_ = (bid.quantity_ - ask.quantity_) / (bid.quantity_ + ask.quantity_);
+        if (bid.best_ && ask.best_)
+        {
+            const double bidSize = bid.best_->quantity_;
+            const double askSize = ask.best_->quantity_;
+            snapshot.microprice_ = (bid.best_->price_ * askSize + ask.best_->price_ * bidSize) / (bidSize + askSize);
+            snapshot.weightedMid_ = (bid.notional_ / bid.quantity_ * ask.quantity_ + ask.notional_ / ask.quantity_ * bid.quantity_) / (bid.quantity_ + ask.quantity_);
+        }
+        snapshot_.Store(snapshot);
+    }
+
+    Touch GetTouch() const
+    {
+        Touch touch;
+        if (!bids_.empty())
+            touch.bid_ = bids_.begin()->first;
+        if (!asks_.empty())
+            touch.ask_ = asks_.begin()->first;
+        if (HasPegs(bidPegs_) && HasPegs(askPegs_)) [[unlikely]]
+        {
+            const Touch levels = touch; //No pegs in it, so the pegs below are only held off the levels
+            if (auto peg = GetBestPeg(Side::Buy, bidPegs_, levels))
+                touch.bidPeg_ = peg->second;
+            if (auto peg = GetBestPeg(Side::Sell, askPegs_, levels))
+                touch.askPeg_ = peg->second;
+        }
+        return touch;
+    }
+
+    //Where a peg sits right now. Offset is in ticks. Pegs never lock or cross the price levels, so they are kept a tick inside the opposite touch
+    //Nothing matches two pegs, so they are also kept a tick inside the opposite best peg. Both sides of a cross step back, which leaves them apart
+    std::optional<Price> ResolvePeg(Side side, PegReference reference, Price offset, const Touch& touch) const
+    {
+        std::optional<Price> base;
+        switch (reference)
+        {
+        case PegReference::Primary:
+            base = side == Side::Buy ? touch.bid_ : touch.ask_;
+            break;
+        case PegReference::Market:
+            base = side == Side::Buy ? touch.ask_ : touch.bid_;
+            break;
+        case PegReference::Midpoint:
+            if (touch.bid_ && touch.ask_)
+                base = side == Side::Buy ? priceSpec_.RoundDown(std::midpoint(*touch.bid_, *touch.ask_)) : priceSpec_.RoundUp(std::midpoint(*touch.ask_, *touch.bid_));
+            break;
+        }
+        if (!base)
+            return std::nullopt; //Nothing to peg to, the order sits out until there is
+
+        auto price = priceSpec_.Offset(*base, offset);
+        if (!price)
+            return std::nullopt;
+        if (side == Side::Buy && touch.ask_)
+            price = std::min(*price, *touch.ask_ - priceSpec_.GetTickSize());
+        if (side == Side::Sell && touch.bid_)
+            price = std::max(*price, *touch.bid_ + priceSpec_.GetTickSize());
+        if (side == Side::Buy && touch.askPeg_)
+            price = std::min(*price, *touch.askPeg_ - priceSpec_.GetTickSize());
+        if (side == Side::Sell && touch.bidPeg_)
+            price = std::max(*price, *touch.bidPeg_ + priceSpec_.GetTickSize());
+        return price;
+    }
+
+    template <typename Compare>
+    static bool HasPegs(const PegLevels<Compare>& pegs)
+    {
+        return !pegs[0].empty() || !pegs[1].empty() || !pegs[2].empty();
+    }
+
+    //Best priced peg level on one side, as its reference and price. Three lookups however many pegs rest
+    template <typename Compare>
+    std::optional<std::pair<std::size_t, Price>> GetBestPeg(Side side, const PegLevels<Compare>& pegs, const Touch& touch) const
+    {
+        std::optional<std::pair<std::size_t, Price>> best;
+        for (std::size_t reference = 0; reference < pegs.size(); ++reference)
+        {
+            if (pegs[reference].empty())
+                continue;
+            auto price = ResolvePeg(side, static_cast<PegReference>(reference), pegs[reference].begin()->first, touch);
+            if (price && (!best || Compare{}(*price, best->second)))
+                best.emplace(reference, *price);
+        }
+        return best;
+    }
+
+    //Best price an order on this side could trade against right now: the opposite touch or the best resolved peg, whichever is better
+    std::optional<Price> GetBestOpposite(Side side) const
+    {
+        const Touch touch = GetTouch();
+        if (side == Side::Buy)
+        {
+            std::optional<Price> best = touch.ask_;
+            if (HasPegs(askPegs_))
+                if (auto peg = GetBestPeg(Side::Sell, askPegs_, touch); peg && (!best || peg->second < *best))
+                    best = peg->second;
+            return best;
+        }
+        std::optional<Price> best = touch.bid_;
+        if (HasPegs(bidPegs_))
+            if (auto peg = GetBestPeg(Side::Buy, bidPegs_, touch); peg && (!best || peg->second > *best))
+                best = peg->second;
+        return best;
+    }
+
+    //Non FAK, match the order to the order book
+    bool CanMatch(Side side, Price price) const //Just need side and price. Const means not mutating anything
+    {
+        const auto best = GetBestOpposite(side);
+        if (!best) //Nothing on the other side, cannot match
+            return false;
+        return side == Side::Buy ? price >= *best : price <= *best; //Buy matches at or above the best ask, sell at or below the best bid
+    }
+
+    //Opposite quantity (hidden included) an order at this price could take right now. Stops counting once enough is found
+    Quantity GetExecutableQuantity(Side side, Price price, Quantity enough) const
+    {
+        Quantity executable = 0;
+        if (side == Side::Buy)
+        {
+            for (auto level = asks_.begin(); level != asks_.end() && level->first <= price && executable < enough; ++level)
+                executable += level->second.GetTotalQuantity();
+        }
+        else
+        {
+            for (auto level = bids_.begin(); level != bids_.end() && level->first >= price && executable < enough; ++level)
+                executable += level->second.GetTotalQuantity();
+        }
+        return executable;
+    }
+
+    //What a waiting all-or-none order is sure to get from the price levels right now. Stops counting where matching could leave it part
+    //filled: an own order that self-trade prevention would act on (cancel resting just takes those away), or a print the band would refuse.
+    //The band is played forward on a copy, fill by fill, since its reference moves with every print
+    Quantity GetAllOrNoneQuantity(const Order& order, Quantity enough) const
+    {
+        const bool preventSelfTrade = selfTradePrevention_ != SelfTradePrevention::None && order.GetOwner() != NoOwner;
+        if (!preventSelfTrade && !priceBand_)
+            return GetExecutableQuantity(order.GetSide(), order.GetPrice(), enough);
+
+        std::optional<PriceBand> band = priceBand_;
+        Quantity executable = 0;
+        auto Walk = [&](const auto& levels, auto crosses)
+        {
+            for (const auto& [price, level] : levels)
+            {
+                if (!crosses(price))
+                    return executable;
+                for (const auto* queue : { &level.orders_, &level.hidden_ })
+                {
+                    for (const auto& resting : *queue)
+                    {
+                        if (executable >= enough)
+                            return executable;
+                        if (preventSelfTrade && resting->GetOwner() == order.GetOwner())
+                        {
+                            if (selfTradePrevention_ == SelfTradePrevention::CancelResting)
+                                continue;
+                            return executable;
+                        }
+                        if (band && !band->Allows(price))
+                            return executable;
+                        const Quantity quantity = std::min(enough - executable, resting->GetRemainingQuantity());
+                        if (band)
+                            band->OnTrade(price, quantity);
+                        executable += quantity;
+                    }
+                }
+            }
+            return executable;
+        };
+        if (order.GetSide() == Side::Buy)
+            return Walk(asks_, [limit = order.GetPrice()](Price price) { return price <= limit; });
+        return Walk(bids_, [limit = order.GetPrice()](Price price) { return price >= limit; });
+    }
+
+    //One resting order's share of the checksum: (id, side, price, remaining), pegs by reference and offset instead of price
+    //Shares are added up, so the total does not depend on which container holds an order or in what order they are visited
+    static std::uint64_t StateHash(const Order& order)
+    {
+        auto Mix = [](std::uint64_t value) //splitmix64 finalizer
+        {
+            value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+            return value ^ (value >> 31);
+        };
+        const std::int64_t price = order.IsPegged() ? order.GetPegOffset() : order.GetPrice();
+        const std::uint64_t kind = (order.GetSide() == Side::Buy ? 0 : 1)
+            | (order.IsPegged() ? 2 + (static_cast<std::uint64_t>(order.GetPegReference()) << 2) : 0);
+        std::uint64_t hash = Mix(order.GetOrderId());
+        hash = Mix(hash ^ static_cast<std::uint64_t>(price) ^ (kind << 56));
+        return Mix(hash ^ order.GetRemainingQuantity());
+    }
+
+    //Order has been queued at iterator. Hook it into every side structure
+    //This is where an order is accepted, so it takes its sequence here and rejected orders leave no gap
+    void Index(const OrderPointer& order, OrderPointers::iterator iterator)
+    {
+        order->Stamp(++eventSequence_, commandTime_);
+        checksum_ += StateHash(*order);
+        orders_.insert({ order->GetOrderId(), OrderEntry{ order, iterator } });
+        owners_[order->GetOwner()].PushBack(*order, order->GetOwnerHook());
+        if (order->GetOrderType() == OrderType::GoodTillDate)
+            expiries_.Schedule(*order);
+        if (listener_)
+            listener_->OnOrderAdded(*order);
+    }
+
+    //Pegs only ever rest. Nothing is priced here, the order just joins its offset level
+    //Queue an order at the back of the level under key (price, or offset for pegs)
+    template <typename Levels>
+    static OrderPointers::iterator Enqueue(Levels& levels, Price key, const OrderPointer& order)
+    {
+        auto& level = levels[key];
+        auto& queue = level.GetQueue(*order);
+        queue.push_back(order);
+        level.Join(*order);
+        level.Add(*order);
+        return std::prev(queue.end());
+    }
+
+    //Take an order off its level without it leaving the book. No events, index entry is the caller's to update
+    template <typename Levels>
+    static void Dequeue(Levels& levels, Price key, const Order& order, OrderPointers::iterator position)
+    {
+        auto level = levels.find(key);
+        level->second.Remove(order);
+        level->second.GetQueue(order).erase(position);
+        if (level->second.IsEmpty())
+            levels.erase(level);
+    }
+
+    template <typename Levels>
+    void CancelQueued(Levels& levels, Price key, OrderPointers::iterator position)
+    {
+        auto level = levels.find(key);
+        CancelInLevel(level->second, position);
+        if (level->second.IsEmpty())
+            levels.erase(level);
+    }
+
+    //Every order in levels [first, last) the predicate picks, one at a time. Returns how many went
+    template <typename Levels, typename Predicate>
+    std::size_t CancelIf(Levels& levels, typename Levels::iterator first, typename Levels::iterator last, Predicate predicate)
+    {
+        std::size_t cancelled = 0;
+        for (auto level = first; level != last; )
+        {
+            for (auto* queue : { &level->second.orders_, &level->second.hidden_ })
+            {
+                for (auto order = queue->begin(); order != queue->end(); )
+                {
+                    auto current = order++;
+                    if (!predicate(**current))
+                        continue;
+                    CancelInLevel(level->second, current);
+                    ++cancelled;
+                }
+            }
+            level = level->second.IsEmpty() ? levels.erase(level) : std::next(level);
+        }
+        return cancelled;
+    }
+
+    template <typename Levels, typename Predicate>
+    std::size_t CancelIf(Levels& levels, Predicate predicate)
+    {
+        return CancelIf(levels, levels.begin(), levels.end(), predicate);
+    }
+
+    //Pegs and all-or-none orders on one side the predicate picks
+    template <typename Predicate>
+    std::size_t CancelOffLevel(Side side, Predicate predicate)
+    {
+        std::size_t cancelled = 0;
+        if (side == Side::Buy)
+        {
+            for (auto& group : bidPegs_)
+                cancelled += CancelIf(group, predicate);
+            return cancelled + CancelIf(bidAllOrNone_, predicate);
+        }
+        for (auto& group : askPegs_)
+            cancelled += CancelIf(group, predicate);
+        return cancelled + CancelIf(askAllOrNone_, predicate);
+    }
+
+    //Pegs only ever rest. Nothing is priced here, the order just joins its offset level
+    Trades AddPeggedOrder(const OrderPointer& order)
+    {
+        if (order->GetOrderType() == OrderType::FillandKill || order->IsAllOrNone())
+            return { };
+
+        const auto reference = static_cast<std::size_t>(order->GetPegReference());
+        Index(order, order->GetSide() == Side::Buy
+            ? Enqueue(bidPegs_[reference], order->GetPegOffset(), order)
+            : Enqueue(askPegs_[reference], order->GetPegOffset(), order));
+        return { };
+    }
+
+    //All-or-none trades right away if the other side can take all of it, otherwise waits. FAK all-or-none is fill or kill
+    Trades AddAllOrNone(const OrderPointer& order)
+    {
+        const Quantity quantity = order->GetRemainingQuantity();
+        const bool fillable = phase_ == TradingPhase::Continuous && GetAllOrNoneQuantity(*order, quantity) >= quantity;
+        if (order->GetOrderType() == OrderType::FillandKill && !fillable)
+            return { };
+
+        Index(order, order->GetSide() == Side::Buy
+            ? Enqueue(bidAllOrNone_, order->GetPrice(), order)
+            : Enqueue(askAllOrNone_, order->GetPrice(), order));
+        Trades trades;
+        if (fillable)
+            ExecuteAllOrNone(order, trades);
+        ReleaseTriggeredStops(trades);
+        return trades;
+    }
+
+    //Move a waiting all-or-none order onto its price level and match it like any aggressor. Caller checked there is enough for all of it.
+    //If matching still stops early (a peg in front that the check did not see) an untouched order goes back to wait and a part filled one is cancelled
+    void ExecuteAllOrNone(OrderPointer order, Trades& trades)
+    {
+        const Touch touch = GetTouch();
+        const Quantity quantity = order->GetRemainingQuantity();
+        auto& location = orders_.at(order->GetOrderId()).location_;
+        if (order->GetSide() == Side::Buy)
+        {
+            Dequeue(bidAllOrNone_, order->GetPrice(), *order, location);
+            location = Enqueue(bids_, order->GetPrice(), order);
+        }
+        else
+        {
+            Dequeue(askAllOrNone_, order->GetPrice(), *order, location);
+            location = Enqueue(asks_, order->GetPrice(), order);
+        }
+
+        auto executed = MatchOrders(order->GetSide(), touch);
+        trades.insert(trades.end(), executed.begin(), executed.end());
+
+        auto left = orders_.find(order->GetOrderId());
+        if (left == orders_.end())
+            return;
+        auto& position = left->second.location_;
+        if (order->GetRemainingQuantity() != quantity) [[unlikely]]
+        {
+            if (order->GetSide() == Side::Buy)
+                CancelQueued(bids_, order->GetPrice(), position);
+            else
+                CancelQueued(asks_, order->GetPrice(), position);
+            return;
+        }
+        if (order->GetSide() == Side::Buy)
+        {
+            Dequeue(bids_, order->GetPrice(), *order, position);
+            position = Enqueue(bidAllOrNone_, order->GetPrice(), order);
+        }
+        else
+        {
+            Dequeue(asks_, order->GetPrice(), *order, position);
+            position = Enqueue(askAllOrNone_, order->GetPrice(), order);
+        }
+    }
+
+    //First waiting all-or-none order, best price first then time, that the other side can now fill completely
+    //Levels that do not even cross end the scan, worse ones cross less
+    template <typename Levels>
+    OrderPointer FindFillableAllOrNone(Side side, const Levels& waiting) const
+    {
+        for (const auto& [price, level] : waiting)
+        {
+            if (!CanMatch(side, price))
+                break;
+            for (const auto* queue : { &level.orders_, &level.hidden_ })
+                for (const auto& order : *queue)
+                    if (GetAllOrNoneQuantity(*order, order->GetRemainingQuantity()) >= order->GetRemainingQuantity())
+                        return order;
+        }
+        return nullptr;
+    }
+
+    //Other side just gained resting liquidity. Only then can a waiting all-or-none order have become fillable
+    void MatchAllOrNone(Side side, Trades& trades)
+    {
+        while (phase_ == TradingPhase::Continuous)
+        {
+            auto order = side == Side::Buy ? FindFillableAllOrNone(side, bidAllOrNone_) : FindFillableAllOrNone(side, askAllOrNone_);
+            if (!order)
+                break;
+            ExecuteAllOrNone(std::move(order), trades);
+        }
+    }
+
+    //Both sides, after an uncross
+    void MatchWaitingAllOrNone(Trades& trades)
+    {
+        if (!bidAllOrNone_.empty())
+            MatchAllOrNone(Side::Buy, trades);
+        if (!askAllOrNone_.empty())
+            MatchAllOrNone(Side::Sell, trades);
+    }
+
+    //Displayed peg quantity at resolved prices, merged into a side's level infos (kept best first)
+    template <typename Compare>
+    void AddPegInfos(Side side, const PegLevels<Compare>& pegs, const Touch& touch, LevelInfos& infos) const
+    {
+        for (std::size_t reference = 0; reference < pegs.size(); ++reference)
+        {
+            for (const auto& [offset, level] : pegs[reference])
+            {
+                auto price = ResolvePeg(side, static_cast<PegReference>(reference), offset, touch);
+                if (price && level.displayedQuantity_ > 0)
+                    infos.push_back(LevelInfo{ *price, level.displayedQuantity_ });
+            }
+        }
+        std::stable_sort(infos.begin(), infos.end(), [](const LevelInfo& lhs, const LevelInfo& rhs) { return Compare{}(lhs.price_, rhs.price_); });
+
+        auto merged = infos.begin();
+        for (auto info = infos.begin(); info != infos.end(); ++info)
+        {
+            if (info != infos.begin() && info->price_ == std::prev(merged)->price_)
+                std::prev(merged)->quantity_ += info->quantity_;
+            else
+                *merged++ = *info;
+        }
+        infos.erase(merged, infos.end());
+    }
+
+    //Level a resting order is queued on
+    PriceLevel& LevelOf(const Order& order)
+    {
+        const bool buy = order.GetSide() == Side::Buy;
+        if (order.IsPegged())
+        {
+            const auto reference = static_cast<std::size_t>(order.GetPegReference());
+            return buy ? bidPegs_[reference].at(order.GetPegOffset()) : askPegs_[reference].at(order.GetPegOffset());
+        }
+        if (order.IsAllOrNone())
+            return buy ? bidAllOrNone_.at(order.GetPrice()) : askAllOrNone_.at(order.GetPrice());
+        return buy ? bids_.at(order.GetPrice()) : asks_.at(order.GetPrice());
+    }
+
+    //Order is leaving the book. Unhook it from every side structure and drop its index entry (last, it may hold the final reference)
+    void Unindex(Order& order)
+    {
+        checksum_ -= StateHash(order);
+        expiries_.Cancel(order);
+        order.GetOwnerHook().Unlink();
+        orders_.erase(order.GetOrderId());
+    }
+
+    //Drop whole levels [first, last) of one side. One aggregated event per level instead of one per order
+    template <typename Levels>
+    std::size_t DropLevels(Side side, Levels& levels, typename Levels::iterator first, typename Levels::iterator last)
+    {
+        std::size_t cancelled = 0;
+        for (auto level = first; level != last; ++level)
+        {
+            const auto& [price, priceLevel] = *level;
+            if (listener_)
+                listener_->OnLevelDeleted(side, price, priceLevel);
+            for (const auto& order : priceLevel.orders_)
+                Unindex(*order); //List node still holds the order
+            for (const auto& order : priceLevel.hidden_)
+                Unindex(*order);
+            cancelled += priceLevel.GetOrderCount();
+        }
+        levels.erase(first, last);
+        return cancelled;
+    }
+
+    //Cancel a group of orders that all rest on the same level. If they are the whole level, it goes in one piece
+    template <typename Levels>
+    std::size_t CancelAtLevel(Side side, Levels& levels, std::vector<Order*>::const_iterator first, std::vector<Order*>::const_iterator last)
+    {
+        auto level = levels.find((*first)->GetPrice());
+        auto& priceLevel = level->second;
+        const auto count = static_cast<std::size_t>(last - first);
+        if (priceLevel.GetOrderCount() == count)
+            return DropLevels(side, levels, level, std::next(level));
+
+        for (; first != last; ++first)
+            CancelInLevel(priceLevel, orders_.at((*first)->GetOrderId()).location_);
+        return count;
+    }
+
+    //Inclusive price range on one side, works for either sort direction
+    template <typename Levels>
+    std::size_t CancelLevelsInRange(Side side, Levels& levels, Price low, Price high)
+    {
+        if (low > high)
+            return 0;
+        const bool ascending = levels.key_comp()(low, high);
+        auto first = levels.lower_bound(ascending ? low : high);
+        auto last = levels.upper_bound(ascending ? high : low);
+        return DropLevels(side, levels, first, last);
+    }
+
+    //Waiting all-or-none orders with low <= price <= high. One at a time, they are not on the price levels
+    template <typename Levels>
+    std::size_t CancelWaitingInRange(Levels& levels, Price low, Price high)
+    {
+        if (low > high)
+            return 0;
+        const bool ascending = levels.key_comp()(low, high);
+        return CancelIf(levels, levels.lower_bound(ascending ? low : high), levels.upper_bound(ascending ? high : low), [](const Order&) { return true; });
+    }
+
+    //Order of a level just traded. Either it is done, or it is an iceberg whose display slice ran out
+    //Iceberg keeps its Order object, list node and orders_ entry. We only splice the node to the back of its queue (time priority lost, no allocation)
+    void Settle(PriceLevel& level, OrderPointers& queue, OrderPointers::iterator position)
+    {
+        auto& order = *position;
+        if (order->isFilled())
+        {
+            Unindex(*order); //erase index entry first, order still referenced by the list node
+            queue.erase(position);
+        }
+        else if (order->GetVisibleQuantity() == 0)
+        {
+            order->Replenish();
+            queue.splice(queue.end(), queue, position); //OrderEntry iterator stays valid
+            level.Join(*order);
+            level.OnReplenish(*order);
+        }
+    }
+
+    //Pull one order out of its level. Caller drops the level if this empties it
+    void CancelInLevel(PriceLevel& level, OrderPointers::iterator position)
+    {
+        auto& order = *position;
+        auto& queue = level.GetQueue(*order);
+        if (listener_)
+            listener_->OnOrderCancelled(*order);
+        level.Remove(*order);
+        Unindex(*order);
+        queue.erase(position);
+    }
+
+    //Trade against a resting order. Its checksum share moves with its remaining quantity
+    void FillInLevel(PriceLevel& level, Order& order, Quantity quantity)
+    {
+        checksum_ -= StateHash(order);
+        order.Fill(quantity);
+        checksum_ += StateHash(order);
+        level.OnFill(order, quantity);
+    }
+
+    void DecrementInLevel(PriceLevel& level, OrderPointers::iterator position, Quantity quantity)
+    {
+        level.Remove(**position);
+        checksum_ -= StateHash(**position);
+        (*position)->Decrement(quantity);
+        checksum_ += StateHash(**position);
+        level.Add(**position);
+        if (listener_)
+            listener_->OnOrderDecremented(**position, quantity);
+        if ((*position)->isFilled())
+            CancelInLevel(level, position);
+    }
+
+    //Aggressor (front of its level) and resting order have the same owner. Configured action replaces the trade
+    void PreventSelfTrade(PriceLevel& aggressorLevel, PriceLevel& restingLevel, OrderPointers::iterator resting)
+    {
+        auto aggressor = aggressorLevel.GetFrontQueue().begin();
+        switch (selfTradePrevention_)
+        {
+        case SelfTradePrevention::None:
+            break;
+        case SelfTradePrevention::CancelResting:
+            CancelInLevel(restingLevel, resting);
+            break;
+        case SelfTradePrevention::CancelAggressor:
+            CancelInLevel(aggressorLevel, aggressor);
+            break;
+        case SelfTradePrevention::CancelBoth:
+            CancelInLevel(restingLevel, resting);
+            CancelInLevel(aggressorLevel, aggressor);
+            break;
+        case SelfTradePrevention::Decrement:
+        {
+            const Quantity quantity = std::min((*aggressor)->GetRemainingQuantity(), (*resting)->GetRemainingQuantity());
+            DecrementInLevel(restingLevel, resting, quantity);
+            DecrementInLevel(aggressorLevel, aggressor, quantity);
+            break;
+        }
+        }
+    }
+
+    void SetTradingPhase(TradingPhase phase)
+    {
+        phase_ = phase;
+        if (listener_)
+            listener_->OnTradingPhaseChanged(phase);
+    }
+
+    //Fill would print outside the band. Either kill what is left of the aggressor or halt into an auction
+    void OnBandBreach(PriceLevel& aggressorLevel)
+    {
+        if (priceBand_->GetConfig().action_ == BandBreachAction::Halt)
+            SetTradingPhase(TradingPhase::Auction);
+        else
+            CancelInLevel(aggressorLevel, aggressorLevel.GetFrontQueue().begin());
+    }
+
+    //Everything that follows the last trade price. Triggered stops are only queued here, they go in once matching is done
+    void OnPrint(Trade& trade, Price price, std::optional<Side> aggressorSide)
+    {
+        trade.Stamp(++eventSequence_, commandTime_);
+        const Quantity quantity = trade.GetBidTrade().quantity_;
+        if (tape_)
+            tape_->Record(now_, price, quantity, aggressorSide, trade.GetBidTrade().orderId_, trade.GetAskTrade().orderId_);
+        lastTradePrice_ = price;
+        if (priceBand_)
+            priceBand_->OnTrade(price, quantity);
+        if (!trailingStops_.IsEmpty()) [[unlikely]]
+            trailingStops_.OnTrade(price, triggeredStops_);
+    }
+
+    //Add every triggered stop in trigger order. Stops their prints trigger join the back of the same queue
+    void ReleaseTriggeredStops(Trades& trades)
+    {
+        if (releasingStops_ || triggeredStops_.empty())
+            return;
+        releasingStops_ = true;
+        for (std::size_t next = 0; next < triggeredStops_.size(); ++next)
+        {
+            auto order = std::move(triggeredStops_[next]);
+            auto stopTrades = AddOrder(order);
+            trades.insert(trades.end(), stopTrades.begin(), stopTrades.end());
+        }
+        triggeredStops_.clear();
+        releasingStops_ = false;
+    }
+
+    //Trade the fronts of two levels against each other until one of them is empty
+    //Continuous matching records each side at its own price, an auction passes the single uncross price
+    //Self-trade prevention needs to know the aggressor, so it only runs in continuous matching. Cost per fill is the owner compare
+    //Same goes for the price band check. Reference follows every fill either way. Returns false if a band breach stopped matching
+    bool MatchLevels(PriceLevel& bidLevel, PriceLevel& askLevel, Trades& trades, std::optional<Side> aggressorSide, std::optional<Price> tradePrice = std::nullopt)
+    {
+        while (!bidLevel.IsEmpty() && !askLevel.IsEmpty())
+        {
+            auto& bids = bidLevel.GetFrontQueue(); //Displayed first, hidden after
+            auto& asks = askLevel.GetFrontQueue();
+            auto& bid = bids.front(); //time price priority
+            auto& ask = asks.front();
+
+            if (bid->GetOwner() == ask->GetOwner() && bid->GetOwner() != NoOwner && aggressorSide && selfTradePrevention_ != SelfTradePrevention::None) [[unlikely]]
+            {
+                if (*aggressorSide == Side::Buy)
+                    PreventSelfTrade(bidLevel, askLevel, asks.begin());
+                else
+                    PreventSelfTrade(askLevel, bidLevel, bids.begin());
+                continue;
+            }
+
+            //Fill prints at the resting order's price in continuous matching
+            const Price executionPrice = tradePrice ? *tradePrice : (*aggressorSide == Side::Buy ? ask->GetPrice() : bid->GetPrice());
+            if (priceBand_ && aggressorSide && !priceBand_->Allows(executionPrice)) [[unlikely]]
+            {
+                OnBandBreach(*aggressorSide == Side::Buy ? bidLevel : askLevel);
+                return false;
+            }
+
+            //Only the visible slice of an iceberg can trade, rest comes after it has gone to the back of the queue
+            Quantity quantity = std::min(bid->GetVisibleQuantity(), ask->GetVisibleQuantity());
+            FillInLevel(bidLevel, *bid, quantity);
+            FillInLevel(askLevel, *ask, quantity);
+
+            //Execute a trade. Record it before settling, settling can drop the front orders
+            trades.push_back(Trade{ 
+                TradeInfo{ bid->GetOrderId(), tradePrice.value_or(bid->GetPrice()), quantity },
+                TradeInfo{ ask->GetOrderId(), tradePrice.value_or(ask->GetPrice()), quantity }
+            });
+            if (listener_)
+            {
+                listener_->OnOrderFilled(*bid, trades.back().GetBidTrade().price_, quantity);
+                listener_->OnOrderFilled(*ask, trades.back().GetAskTrade().price_, quantity);
+            }
+            OnPrint(trades.back(), executionPrice, aggressorSide);
+
+            Settle(bidLevel, bids, bids.begin());
+            Settle(askLevel, asks, asks.begin());
+        }
+        return true;
+    }
+
+    //Non FIFO policies. The front of the aggressor level is shared across the whole resting level in one go
+    //Whole level prints at one price, so the band is checked once per allocation round
+    bool MatchByAllocation(PriceLevel& aggressorLevel, PriceLevel& restingLevel, Side aggressorSide, Trades& trades, std::optional<Price> tradePrice = std::nullopt)
+    {
+        while (!aggressorLevel.IsEmpty() && !restingLevel.IsEmpty())
+        {
+            auto& aggressorQueue = aggressorLevel.GetFrontQueue();
+            auto& aggressor = aggressorQueue.front();
+            auto& resting = restingLevel.GetFrontQueue(); //Displayed orders share first, hidden ones only once those are gone
+            const OwnerId owner = aggressor->GetOwner();
+
+            restingQuantities_.clear();
+            bool selfTrade = false;
+            for (const auto& order : resting)
+            {
+                restingQuantities_.push_back(order->GetVisibleQuantity());
+                selfTrade |= order->GetOwner() == owner;
+            }
+
+            //Own orders are taken out of the level (or the aggressor goes) before anything is allocated, then we look again
+            if (selfTrade && owner != NoOwner && selfTradePrevention_ != SelfTradePrevention::None) [[unlikely]]
+            {
+                for (auto order = resting.begin(); order != resting.end() && !aggressorQueue.empty() && aggressorQueue.front()->GetOwner() == owner; )
+                {
+                    auto current = order++;
+                    if ((*current)->GetOwner() == owner)
+                        PreventSelfTrade(aggressorLevel, restingLevel, current);
+                }
+                continue;
+            }
+
+            const Price executionPrice = tradePrice.value_or(resting.front()->GetPrice());
+            if (priceBand_ && !priceBand_->Allows(executionPrice)) [[unlikely]]
+            {
+                OnBandBreach(aggressorLevel);
+                return false;
+            }
+
+            allocations_.resize(restingQuantities_.size());
+            AllocationPolicy::Allocate(restingQuantities_.data(), restingQuantities_.size(), aggressor->GetVisibleQuantity(), allocations_.data());
+
+            Quantity filled = 0;
+            auto next = resting.begin();
+            for (Quantity quantity : allocations_) //Walk exactly the orders we allocated over, replenished icebergs get spliced behind them
+            {
+                auto current = next++;
+                if (quantity == 0)
+                    continue;
+
+                auto& order = *current;
+                FillInLevel(restingLevel, *order, quantity);
+                filled += quantity;
+                const TradeInfo aggressorInfo{ aggressor->GetOrderId(), tradePrice.value_or(aggressor->GetPrice()), quantity };
+                const TradeInfo restingInfo{ order->GetOrderId(), tradePrice.value_or(order->GetPrice()), quantity };
+                trades.push_back(aggressorSide == Side::Buy ? Trade{ aggressorInfo, restingInfo } : Trade{ restingInfo, aggressorInfo });
+                if (listener_)
+                    listener_->OnOrderFilled(*order, restingInfo.price_, quantity);
+                OnPrint(trades.back(), executionPrice, aggressorSide);
+
+                Settle(restingLevel, resting, current);
+            }
+
+            FillInLevel(aggressorLevel, *aggressor, filled);
+            if (listener_)
+                listener_->OnOrderFilled(*aggressor, tradePrice.value_or(aggressor->GetPrice()), filled);
+            Settle(aggressorLevel, aggressorQueue, aggressorQueue.begin());
+        }
+        return true;
+    }
+
+    //Aggressor level against the best pegged level on the other side, if that peg is strictly better than the price levels and crosses
+    //Returns nullopt if the pegs are not in front, otherwise whether to keep matching
+    template <typename AggressorLevels, typename Compare>
+    std::optional<bool> MatchBestPeg(Side aggressorSide, AggressorLevels& aggressorLevels, PegLevels<Compare>& pegs, std::optional<Price> restingTouch, const Touch& touch, Trades& trades)
+    {
+        const Side restingSide = aggressorSide == Side::Buy ? Side::Sell : Side::Buy;
+        auto best = GetBestPeg(restingSide, pegs, touch);
+        if (!best || aggressorLevels.empty())
+            return std::nullopt;
+        const auto [reference, price] = *best;
+        if (restingTouch && !Compare{}(price, *restingTouch))
+            return std::nullopt; //Price levels win ties
+        auto aggressorLevel = aggressorLevels.begin();
+        if (Compare{}(aggressorLevel->first, price))
+            return std::nullopt; //Does not cross
+
+        auto& group = pegs[reference];
+        auto pegLevel = group.begin();
+        bool keepMatching;
+        if constexpr (AllocationPolicy::TimePriorityOnly)
+        {
+            if (aggressorSide == Side::Buy)
+                keepMatching = MatchLevels(aggressorLevel->second, pegLevel->second, trades, aggressorSide, price);
+            else
+                keepMatching = MatchLevels(pegLevel->second, aggressorLevel->second, trades, aggressorSide, price);
+        }
+        else
+            keepMatching = MatchByAllocation(aggressorLevel->second, pegLevel->second, aggressorSide, trades, price);
+
+        if (aggressorLevel->second.IsEmpty())
+            aggressorLevels.erase(aggressorLevel);
+        if (pegLevel->second.IsEmpty())
+            group.erase(pegLevel);
+        return keepMatching;
+    }
+
+    //Match function. Have orders in the order book that need to be resolved
+    //Return trades that happened as a result of matching. Aggressor side only matters to non FIFO policies
+    //Pegs are priced off the touch from before the aggressor arrived, and stay at that price for the whole sweep
+    Trades MatchOrders(Side aggressorSide, const Touch& touch)
+    {
+        Trades trades;
+        trades.reserve(orders_.size());
+        while(true)
+        {
+            if (aggressorSide == Side::Buy && HasPegs(askPegs_))
+            {
+                auto matched = MatchBestPeg(aggressorSide, bids_, askPegs_, asks_.empty() ? std::nullopt : std::optional{ asks_.begin()->first }, touch, trades);
+                if (matched && !*matched)
+                    break;
+                if (matched)
+                    continue;
+            }
+            if (aggressorSide == Side::Sell && HasPegs(bidPegs_))
+            {
+                auto matched = MatchBestPeg(aggressorSide, asks_, bidPegs_, bids_.empty() ? std::nullopt : std::optional{ bids_.begin()->first }, touch, trades);
+                if (matched && !*matched)
+                    break;
+                if (matched)
+                    continue;
+            }
+
+            if(bids_.empty() || asks_.empty()) //if no bids or asks we will break
+                break;
+
+            auto bidLevel = bids_.begin();
+            auto askLevel = asks_.begin();
+            auto& [bidPrice, bids] = *bidLevel;
+            auto& [askPrice, asks] = *askLevel;
+
+            if (bidPrice < askPrice) //No more matches possible
+                break;
+
+            bool keepMatching;
+            if constexpr (AllocationPolicy::TimePriorityOnly)
+                keepMatching = MatchLevels(bids, asks, trades, aggressorSide);
+            else if (aggressorSide == Side::Buy)
+                keepMatching = MatchByAllocation(bids, asks, Side::Buy, trades);
+            else
+                keepMatching = MatchByAllocation(asks, bids, Side::Sell, trades);
+
+            //What if we have no bids or asks remaining in this price level
+            if (bids.IsEmpty())
+                bids_.erase(bidLevel);
+            if (asks.IsEmpty())
+                asks_.erase(askLevel);
+            if (!keepMatching) //Band breach, either killed the aggressor or halted us
+                break;
+        }
+
+        //If FOK order, and it hasn't been fully filled, its still gonna be in order book and we need to remove it
+        //Straight off the price level, an all-or-none order being executed sits here and not in its waiting map
+        if (!bids_.empty())
+        {
+            auto& [price, bids] = *bids_.begin();
+            auto front = bids.GetFrontQueue().begin();
+            if ((*front)->GetOrderType() == OrderType::FillandKill)
+                CancelQueued(bids_, price, front);
+        }
+        if (!asks_.empty())
+        {
+            auto& [price, asks] = *asks_.begin();
+            auto front = asks.GetFrontQueue().begin();
+            if ((*front)->GetOrderType() == OrderType::FillandKill)
+                CancelQueued(asks_, price, front);
+        }
+
+        return trades;
+    }
+
+public:
+    //memory has to outlive the book, and every order made with MakeOrder
+    explicit BasicOrderbook(const PriceSpec& priceSpec = PriceSpec{ }, std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+    : memory_{ memory }
+    , bids_{ memory }
+    , asks_{ memory }
+    , bidPegs_{ { LevelMap<std::greater<Price>>{ memory }, LevelMap<std::greater<Price>>{ memory }, LevelMap<std::greater<Price>>{ memory } } }
+    , askPegs_{ { LevelMap<std::less<Price>>{ memory }, LevelMap<std::less<Price>>{ memory }, LevelMap<std::less<Price>>{ memory } } }
+    , bidAllOrNone_{ memory }
+    , askAllOrNone_{ memory }
+    , orders_{ memory }
+    , owners_{ memory }
+    , priceSpec_{ priceSpec }
+    { }
+
+    //Order (and its shared_ptr control block) allocated from the book's memory, next to its list node and index entry
+    template <typename... Args>
+    OrderPointer MakeOrder(Args&&... args) const
+    {
+        return std::allocate_shared<Order>(std::pmr::polymorphic_allocator<Order>{ memory_ }, std::forward<Args>(args)...);
+    }
+
+    const PriceSpec& GetPriceSpec() const { return priceSpec_; }
+    std::pmr::memory_resource* GetMemoryResource() const { return memory_; }
+
+    //Everytime you add an oder you can match, return trades if any. In an auction the order only rests
+    Trades AddOrder(OrderPointer order) //non const because you can mutate this
+    { 
+        const CommandScope command{ *this };
+        if (orders_.find(order->GetOrderId()) != orders_.end())
+            return { }; //Order already exists, cannot add again
+        if (!order->IsPegged() && !priceSpec_.IsOnTick(order->GetPrice()))
+            return { }; //Off the instrument's tick
+        if (order->GetOrderType() == OrderType::FillandKill && (phase_ == TradingPhase::Auction || !CanMatch(order->GetSide(), order->GetPrice())))
+            return { }; //Cannot match FAK order, so we dont add it. Nothing matches during an auction either
+        if (order->GetOrderType() == OrderType::GoodTillDate && order->GetExpiry() <= now_)
+            return { }; //Already expired
+        if (order->IsPegged())
+            return AddPeggedOrder(order);
+        if (order->IsAllOrNone())
+            return AddAllOrNone(order);
+        if (phase_ == TradingPhase::Continuous && CanMatch(order->GetSide(), order->GetPrice()))
+        {
+            //Would take liquidity right away. Not enough on the other side to fill the minimum in one go, whatever else the order says
+            if (order->HasAttribute(OrderAttribute::MinimumQuantity) && GetExecutableQuantity(order->GetSide(), order->GetPrice(), order->GetMinimumQuantity()) < order->GetMinimumQuantity())
+                return { };
+            //Post-only either goes away or steps back behind the touch
+            if (order->HasAttribute(OrderAttribute::PostOnly))
+                return { };
+            if (order->HasAttribute(OrderAttribute::PostOnlyReprice))
+            {
+                //Behind the better of the levels and the pegs, either of which can be what crosses
+                const auto best = GetBestOpposite(order->GetSide());
+                auto price = order->GetSide() == Side::Buy ? priceSpec_.Offset(*best, -1) : priceSpec_.Offset(*best, 1);
+                if (!price)
+                    return { };
+                order->Reprice(*price);
+            }
+        }
+
+        const Touch touch = GetTouch(); //Before this order moves it
+        //Iterator to the back of the level, where the order just went
+        auto iterator = order->GetSide() == Side::Buy ? Enqueue(bids_, order->GetPrice(), order) : Enqueue(asks_, order->GetPrice(), order);
+        Index(order, iterator);
+        if (phase_ == TradingPhase::Auction)
+            return { };
+        auto trades = MatchOrders(order->GetSide(), touch);
+        const bool waitingAllOrNone = order->GetSide() == Side::Buy ? !askAllOrNone_.empty() : !bidAllOrNone_.empty();
+        if (waitingAllOrNone && orders_.find(order->GetOrderId()) != orders_.end()) [[unlikely]]
+            MatchAllOrNone(order->GetSide() == Side::Buy ? Side::Sell : Side::Buy, trades);
+        ReleaseTriggeredStops(trades);
+        return trades;
+    }
+
+    //Now we do cancel first. Modify is just a cancel and a replace. So need cancel
+
+    void CancelOrder(OrderId orderId) 
+    {
+        const CommandScope command{ *this };
+        if (orders_.find(orderId) == orders_.end())
+            return; //Order does not exist, nothing to cancel
+
+        const auto& [order, orderIterator] = orders_.at(orderId);
+        const auto position = orderIterator; //Copy, the entry goes away inside CancelInLevel
+        
+        if (order->IsPegged())
+        {
+            const auto reference = static_cast<std::size_t>(order->GetPegReference());
+            if (order->GetSide() == Side::Buy)
+                CancelQueued(bidPegs_[reference], order->GetPegOffset(), position);
+            else
+                CancelQueued(askPegs_[reference], order->GetPegOffset(), position);
+        }
+        else if (order->IsAllOrNone())
+        {
+            if (order->GetSide() == Side::Buy)
+                CancelQueued(bidAllOrNone_, order->GetPrice(), position);
+            else
+                CancelQueued(askAllOrNone_, order->GetPrice(), position);
+        }
+        else if (order->GetSide() == Side::Sell)
+        { 
+            auto level = asks_.find(order->GetPrice());
+            CancelInLevel(level->second, position);
+            if (level->second.IsEmpty())
+                asks_.erase(level); //If no more orders at this price level, remove the price level
+        }
+        else
+        {
+            auto level = bids_.find(order->GetPrice());
+            CancelInLevel(level->second, position);
+            if (level->second.IsEmpty())
+                bids_.erase(level);
+        }
+    }
+
+    //Mass cancels for risk. Each returns how many orders went away
+    //Everything an owner has resting. Orders are grouped by level so a level that is all theirs is dropped in one go
+    std::size_t CancelAll(OwnerId owner)
+    {
+        const CommandScope command{ *this };
+        auto found = owners_.find(owner);
+        if (found == owners_.end() || found->second.empty())
+            return 0;
+
+        std::vector<Order*> victims; //Gather first, cancelling unlinks from the list we would be walking
+        std::vector<OrderId> offLevel;
+        found->second.ForEach([&victims, &offLevel](Order& order)
+        {
+            if (order.IsPegged() || order.IsAllOrNone())
+                offLevel.push_back(order.GetOrderId()); //Not on a price level, these go one at a time
+            else
+                victims.push_back(&order);
+        });
+        for (OrderId orderId : offLevel)
+            CancelOrder(orderId);
+        std::sort(victims.begin(), victims.end(), [](const Order* lhs, const Order* rhs)
+            { return std::tuple{ lhs->GetSide(), lhs->GetPrice() } < std::tuple{ rhs->GetSide(), rhs->GetPrice() }; });
+
+        std::size_t cancelled = offLevel.size();
+        for (auto group = victims.cbegin(); group != victims.cend(); )
+        {
+            const Side side = (*group)->GetSide();
+            const Price price = (*group)->GetPrice();
+            auto groupEnd = std::find_if(group, victims.cend(), [side, price](const Order* order)
+                { return order->GetSide() != side || order->GetPrice() != price; });
+            cancelled += side == Side::Buy ? CancelAtLevel(side, bids_, group, groupEnd) : CancelAtLevel(side, asks_, group, groupEnd);
+            group = groupEnd;
+        }
+        return cancelled;
+    }
+
+    std::size_t CancelSide(Side side)
+    {
+        const CommandScope command{ *this };
+        if (side == Side::Buy)
+            return CancelOffLevel(side, [](const Order&) { return true; }) + DropLevels(side, bids_, bids_.begin(), bids_.end());
+        return CancelOffLevel(side, [](const Order&) { return true; }) + DropLevels(side, asks_, asks_.begin(), asks_.end());
+    }
+
+    //Every level on one side with low <= price <= high, and the all-or-none orders waiting in that range. Pegs have no fixed price and are left alone
+    std::size_t CancelRange(Side side, Price low, Price high)
+    {
+        const CommandScope command{ *this };
+        if (side == Side::Buy)
+            return CancelWaitingInRange(bidAllOrNone_, low, high) + CancelLevelsInRange(side, bids_, low, high);
+        return CancelWaitingInRange(askAllOrNone_, low, high) + CancelLevelsInRange(side, asks_, low, high);
+    }
+    //Modify order
+    Trades MatchOrder(OrderModify order)
+    {
+        const CommandScope command{ *this };
+        if (orders_.find(order.GetOrderId()) == orders_.end())
+            return { }; //Order does not exist, cannot modify
+
+        //Copy what we need before cancelling, the entry goes away with the cancel
+        const auto& [existingOrder, _] = orders_.at(order.GetOrderId());
+        const OrderType type = existingOrder->GetOrderType();
+        const bool isIceberg = existingOrder->IsIceberg();
+        const Quantity displayQuantity = existingOrder->GetDisplayQuantity();
+        const Timestamp expiry = existingOrder->GetExpiry();
+        const OwnerId owner = existingOrder->GetOwner();
+        const OrderAttribute attributes = existingOrder->GetAttributes();
+        const Quantity minimumQuantity = existingOrder->GetMinimumQuantity();
+        const PegReference pegReference = existingOrder->GetPegReference();
+        const Price pegOffset = existingOrder->GetPegOffset();
+        CancelOrder(order.GetOrderId());
+        auto replacement = isIceberg ? order.ToOrderPointer(type, displayQuantity, memory_) : order.ToOrderPointer(type, memory_);
+        replacement->SetExpiry(expiry);
+        replacement->SetOwner(owner);
+        replacement->AddAttributes(attributes);
+        if (replacement->HasAttribute(OrderAttribute::MinimumQuantity))
+            replacement->SetMinimumQuantity(minimumQuantity);
+        if (replacement->IsPegged())
+            replacement->SetPeg(pegReference, pegOffset);
+        return AddOrder(replacement);
+    }
+
+    //Drive the book clock forward. Every GTD order whose expiry has been reached is removed, returns their ids
+    OrderIds AdvanceTime(Timestamp now)
+    {
+        const CommandScope command{ *this };
+        OrderIds expired;
+        if (now <= now_)
+            return expired; //Clock only moves forward
+        now_ = now;
+        expiries_.Advance(now, expired);
+        for (OrderId orderId : expired)
+            CancelOrder(orderId);
+        return expired;
+    }
+
+    //Session end. Expires due GTD orders, then every DAY order in one sweep over the levels
+    //Level made up of only DAY orders is dropped as a whole instead of unlinking order by order. Returns how many orders expired
+    std::size_t EndSession(Timestamp sessionEnd)
+    {
+        const CommandScope command{ *this };
+        std::size_t expired = AdvanceTime(sessionEnd).size();
+
+        auto ExpireDayOrders = [this, &expired](Side side, auto& levels)
+        {
+            auto IsDayOrder = [](const OrderPointer& order) { return order->GetOrderType() == OrderType::GoodForDay; };
+            for (auto level = levels.begin(); level != levels.end(); )
+            {
+                auto next = std::next(level);
+                auto& priceLevel = level->second;
+                if (std::all_of(priceLevel.orders_.begin(), priceLevel.orders_.end(), IsDayOrder) &&
+                    std::all_of(priceLevel.hidden_.begin(), priceLevel.hidden_.end(), IsDayOrder))
+                {
+                    expired += DropLevels(side, levels, level, next); //Whole level goes at once
+                    level = next;
+                    continue;
+                }
+                auto ExpireFrom = [&](OrderPointers& queue)
+                {
+                    queue.remove_if([this, &expired, &IsDayOrder, &priceLevel](const OrderPointer& order)
+                    {
+                        if (!IsDayOrder(order))
+                            return false;
+                        if (listener_)
+                            listener_->OnOrderCancelled(*order);
+                        priceLevel.Remove(*order);
+                        Unindex(*order);
+                        ++expired;
+                        return true;
+                    });
+                };
+                ExpireFrom(priceLevel.orders_);
+                ExpireFrom(priceLevel.hidden_);
+                level = next;
+            }
+        };
+
+        ExpireDayOrders(Side::Buy, bids_);
+        ExpireDayOrders(Side::Sell, asks_);
+        auto IsDayOrder = [](const Order& order) { return order.GetOrderType() == OrderType::GoodForDay; };
+        expired += CancelOffLevel(Side::Buy, IsDayOrder);
+        expired += CancelOffLevel(Side::Sell, IsDayOrder);
+        return expired;
+    }
+
+    Timestamp GetTime() const { return now_; }
+
+    //Call auction. From here on orders accumulate (book may cross) until Uncross
+    void StartAuction() { SetTradingPhase(TradingPhase::Auction); }
+    TradingPhase GetTradingPhase() const { return phase_; }
+
+    //Equilibrium price if we uncrossed now. Maximum executable volume, then smallest imbalance, then closest to the reference price, then lowest price
+    //One linear merge over cumulative bid/ask depth of the crossed region, no trial matching
+    std::optional<AuctionResult> GetIndicativeUncross(std::optional<Price> referencePrice = std::nullopt) const
+    {
+        if (bids_.empty() || asks_.empty())
+            return std::nullopt;
+        const Price bestBid = bids_.begin()->first;
+        const Price bestAsk = asks_.begin()->first;
+        if (bestBid < bestAsk)
+            return std::nullopt; //Not crossed, nothing to execute
+        if (referencePrice)
+            referencePrice = priceSpec_.RoundNearest(*referencePrice); //It can win the tie break and become the trade price, so it goes on the tick
+
+        //Depth per level of the crossed region, straight from the level totals. Iceberg reserve takes part too
+        std::vector<std::pair<Price, std::uint64_t>> bidDepth, askDepth; //Both ascending by price
+        std::uint64_t totalBid = 0;
+        for (auto level = bids_.begin(); level != bids_.end() && level->first >= bestAsk; ++level)
+        {
+            bidDepth.emplace_back(level->first, level->second.GetTotalQuantity());
+            totalBid += bidDepth.back().second;
+        }
+        std::reverse(bidDepth.begin(), bidDepth.end());
+        for (auto level = asks_.begin(); level != asks_.end() && level->first <= bestBid; ++level)
+            askDepth.emplace_back(level->first, level->second.GetTotalQuantity());
+
+        std::optional<AuctionResult> best;
+        std::uint64_t cumulativeAsk = 0; //Asks at or below the candidate
+        std::uint64_t bidsBelow = 0; //Bids strictly below the candidate
+        std::size_t bidIndex = 0, askIndex = 0;
+        const bool hasReference = referencePrice && *referencePrice >= bestAsk && *referencePrice <= bestBid;
+        bool referenceDone = !hasReference;
+
+        auto Evaluate = [&](Price price)
+        {
+            while (askIndex < askDepth.size() && askDepth[askIndex].first <= price)
+                cumulativeAsk += askDepth[askIndex++].second;
+            while (bidIndex < bidDepth.size() && bidDepth[bidIndex].first < price)
+                bidsBelow += bidDepth[bidIndex++].second;
+
+            const std::uint64_t cumulativeBid = totalBid - bidsBelow;
+            const AuctionResult candidate{ price, std::min(cumulativeBid, cumulativeAsk),
+                static_cast<std::int64_t>(cumulativeBid) - static_cast<std::int64_t>(cumulativeAsk) };
+            auto Distance = [&referencePrice](Price p) { return referencePrice ? std::abs(static_cast<std::int64_t>(p) - *referencePrice) : 0; };
+
+            if (!best
+                || candidate.volume_ > best->volume_
+                || (candidate.volume_ == best->volume_ && std::abs(candidate.imbalance_) < std::abs(best->imbalance_))
+                || (candidate.volume_ == best->volume_ && std::abs(candidate.imbalance_) == std::abs(best->imbalance_) && Distance(price) < Distance(best->price_)))
+                best = candidate;
+        };
+
+        //Candidates are every level price plus the reference, walked once in ascending order
+        std::size_t nextBid = 0, nextAsk = 0;
+        while (nextBid < bidDepth.size() || nextAsk < askDepth.size() || !referenceDone)
+        {
+            Price price = std::numeric_limits<Price>::max();
+            if (nextBid < bidDepth.size())
+                price = std::min(price, bidDepth[nextBid].first);
+            if (nextAsk < askDepth.size())
+                price = std::min(price, askDepth[nextAsk].first);
+            if (!referenceDone)
+                price = std::min(price, *referencePrice);
+
+            while (nextBid < bidDepth.size() && bidDepth[nextBid].first == price)
+                ++nextBid;
+            while (nextAsk < askDepth.size() && askDepth[nextAsk].first == price)
+                ++nextAsk;
+            if (!referenceDone && *referencePrice == price)
+                referenceDone = true;
+
+            Evaluate(price);
+        }
+        return best;
+    }
+
+    //Ends the auction. Everything executable trades at the single equilibrium price, then the book goes back to continuous matching
+    Trades Uncross(std::optional<Price> referencePrice = std::nullopt)
+    {
+        const CommandScope command{ *this };
+        SetTradingPhase(TradingPhase::Continuous);
+        const auto result = GetIndicativeUncross(referencePrice);
+        Trades trades;
+        if (!result)
+        {
+            MatchWaitingAllOrNone(trades); //Orders that came in during the auction only waited
+            ReleaseTriggeredStops(trades);
+            return trades;
+        }
+
+        const Price price = result->price_;
+        while (!bids_.empty() && !asks_.empty())
+        {
+            auto bidLevel = bids_.begin();
+            auto askLevel = asks_.begin();
+            if (bidLevel->first < price || askLevel->first > price)
+                break; //One side has nothing left at or through the equilibrium price
+
+            MatchLevels(bidLevel->second, askLevel->second, trades, std::nullopt, price);
+
+            if (bidLevel->second.IsEmpty())
+                bids_.erase(bidLevel);
+            if (askLevel->second.IsEmpty())
+                asks_.erase(askLevel);
+        }
+        MatchWaitingAllOrNone(trades); //Whatever is left on the levels, and the orders that came in during the auction, may fill them now
+        ReleaseTriggeredStops(trades);
+        return trades;
+    }
+
+    //Trailing stop waits off book and is added as order once triggered. Needs a trade to start its watermark from
+    bool AddTrailingStop(OrderPointer order, TrailingOffset offset)
+    {
+        if (!lastTradePrice_ || order->IsPegged() || orders_.find(order->GetOrderId()) != orders_.end())
+            return false;
+        return trailingStops_.Add(order, offset, *lastTradePrice_);
+    }
+
+    bool CancelTrailingStop(OrderId orderId) { return trailingStops_.Cancel(orderId); }
+    std::size_t GetTrailingStopCount() const { return trailingStops_.Size(); }
+    std::optional<Price> GetLastTradePrice() const { return lastTradePrice_; }
+
+    //Applies to continuous matching between orders with the same (non NoOwner) owner
+    void SetSelfTradePrevention(SelfTradePrevention mode) { selfTradePrevention_ = mode; }
+    SelfTradePrevention GetSelfTradePrevention() const { return selfTradePrevention_; }
+
+    //Continuous fills outside the band around the reference either reject the aggressor or halt the book into an auction
+    void SetPriceBand(const PriceBandConfig& config) { priceBand_.emplace(config); }
+    void ClearPriceBand() { priceBand_.reset(); }
+    std::optional<Price> GetReferencePrice() const { return priceBand_ ? priceBand_->GetReference() : std::nullopt; }
+
+    //Book does not own the listener. nullptr turns events off
+    void SetListener(OrderbookListener* listener) { listener_ = listener; }
+
+    //Know how. many orders
+    std::size_t Size() const { return orders_.size(); }
+
+    //Visible quantity that trades before a resting order at its level. nullopt if it is not resting
+    //Pegs and waiting all-or-none orders are counted within their own level
+    std::optional<Quantity> QueueAhead(OrderId orderId)
+    {
+        auto found = orders_.find(orderId);
+        if (found == orders_.end())
+            return std::nullopt;
+        const Order& order = *found->second.order_;
+        return LevelOf(order).GetQuantityAhead(order);
+    }
+
+    //Publish a MarketSnapshot after every command from now on. Until then the book does no snapshot work
+    void EnableMarketSnapshot(const MarketSnapshotConfig& config = MarketSnapshotConfig{})
+    {
+        if (config.imbalanceLevels_ == 0)
+            throw std::logic_error("Imbalance needs at least one level");
+        snapshotConfig_ = config;
+        PublishSnapshot();
+    }
+
+    //Any thread, lock free, O(1). Never blocks the thread running the book
+    MarketSnapshot GetMarketSnapshot() const { return snapshot_.Load(); }
+
+    //Stamp orders and trades with this clock, read once per command. nullptr (the default) leaves times at 0
+    void SetClock(const TscClock* clock) { clock_ = clock; }
+    //Time the current (or last) command came in, for measuring the stages around it on the same clock
+    Timestamp GetCommandTime() const { return commandTime_; }
+    std::uint64_t GetSequence() const { return eventSequence_; }
+
+    //Keep every execution on a tape of the last capacity trades, with OHLCV/VWAP bars for each interval (book clock units)
+    void EnableTradeTape(std::size_t capacity, const std::vector<Timestamp>& barIntervals, std::size_t barHistory = 64)
+    {
+        tape_.emplace(capacity, barIntervals, barHistory);
+    }
+    void DisableTradeTape() { tape_.reset(); }
+    const TradeTape* GetTradeTape() const { return tape_ ? &*tape_ : nullptr; }
+
+    //Levels per side the depth queries can see. Deeper costs more to refresh after the book changes
+    void SetLadderDepth(std::size_t levels)
+    {
+        ladderDepth_ = levels;
+        laddersStale_ = true;
+    }
+
+    //Average and worst price an aggressive order of this size on side would get from displayed depth right now
+    //Hidden size, pegs and self-trade prevention are not taken into account
+    FillEstimate EstimateFill(Side side, Quantity quantity)
+    {
+        const DepthLadder& ladder = GetOppositeLadder(side);
+        const LadderSweep sweep = SweepLadder(ladder.keys_.data(), ladder.quantities_.data(), ladder.keys_.size(), quantity);
+        FillEstimate estimate;
+        estimate.quantity_ = static_cast<Quantity>(sweep.quantity_);
+        estimate.levels_ = sweep.levels_;
+        if (sweep.levels_ == 0)
+            return estimate;
+        const double sign = side == Side::Buy ? 1.0 : -1.0;
+        estimate.averagePrice_ = sign * sweep.notional_ / sweep.quantity_;
+        estimate.worstPrice_ = static_cast<Price>(sign * ladder.keys_[sweep.levels_ - 1]);
+        return estimate;
+    }
+
+    //Displayed quantity an aggressive order on side could take within ticks of the opposite touch
+    Quantity GetQuantityWithin(Side side, std::int64_t ticks)
+    {
+        const DepthLadder& ladder = GetOppositeLadder(side);
+        if (ladder.keys_.empty() || ticks < 0)
+            return 0;
+        const double limit = ladder.keys_.front() + static_cast<double>(ticks) * priceSpec_.GetTickSize();
+        return static_cast<Quantity>(SumLadderWithin(ladder.keys_.data(), ladder.quantities_.data(), ladder.keys_.size(), limit));
+    }
+
+    //Rolling hash of every resting order, kept up on add, fill and cancel. Two books holding the same orders have the same checksum
+    std::uint64_t GetChecksum() const { return checksum_; }
+
+    //Best displayed price levels on one side, at most depth of them. Only walks as far as it returns. Pegs are not included
+    LevelInfos GetTopLevels(Side side, std::size_t depth) const
+    {
+        LevelInfos infos;
+        auto Collect = [&infos, depth](const auto& levels)
+        {
+            for (auto level = levels.begin(); level != levels.end() && infos.size() < depth; ++level)
+                if (level->second.displayedQuantity_ > 0)
+                    infos.push_back(LevelInfo{ level->first, level->second.displayedQuantity_ });
+        };
+        if (side == Side::Buy)
+            Collect(bids_);
+        else
+            Collect(asks_);
+        return infos;
+    }
+
+    //Get current state of order book
+    OrderbookLevelInfos GetOrderInfos() const
+    { 
+        LevelInfos bidInfos, askInfos;
+        bidInfos.reserve(bids_.size());
+        askInfos.reserve(asks_.size());
+
+        //Only what is displayed. Iceberg reserve and hidden orders stay out, a level with nothing shown is not listed at all
+        for (const auto& [price, level] : bids_)
+            if (level.displayedQuantity_ > 0)
+                bidInfos.push_back(LevelInfo{ price, level.displayedQuantity_ });
+        for (const auto& [price, level] : asks_)
+            if (level.displayedQuantity_ > 0)
+                askInfos.push_back(LevelInfo{ price, level.displayedQuantity_ });
+
+        //Pegs are priced here, against the current touch, and folded into the levels they land on
+        const Touch touch = GetTouch();
+        if (HasPegs(bidPegs_))
+            AddPegInfos(Side::Buy, bidPegs_, touch, bidInfos);
+        if (HasPegs(askPegs_))
+            AddPegInfos(Side::Sell, askPegs_, touch, askInfos);
+
+        return OrderbookLevelInfos{ bidInfos, askInfos };
+    }
+};
+
+using Orderbook = BasicOrderbook<FifoAllocation>;
+
+//Pre-trade risk. Limits are per account (owner id). Position is in lots, notional in price units * lots
+struct RiskLimits
+{
+    Quantity maxOrderQuantity_{ 0 };
+    std::int64_t maxNotional_{ 0 };
+    std::uint32_t maxOpenOrders_{ 0 };
+    std::int64_t maxGrossPosition_{ 0 }; //Position either way plus everything still open on both sides
+    std::int64_t maxNetPosition_{ 0 }; //Position if every open order on the order's side filled
+};
+
+enum class RiskCheck
+{
+    Accepted,
+    UnknownAccount, //Account outside the table or never given limits
+    OrderQuantity,
+    Notional,
+    OpenOrders,
+    GrossPosition,
+    NetPosition
+};
+
+//Sits in front of AddOrder. Per account state lives in flat arrays indexed by account id and is kept current
+//from the book's ack/fill/cancel events, so a check is a handful of compares and never looks at open orders
+class RiskGate : public OrderbookListener
+{
+public:
+    explicit RiskGate(std::size_t maxAccounts)
+    : limits_(maxAccounts)
+    , accounts_(maxAccounts)
+    { }
+
+    void SetLimits(OwnerId account, const RiskLimits& limits)
+    {
+        limits_.at(account) = limits;
+        accounts_.at(account).configured_ = true;
+    }
+
+    RiskCheck Check(const Order& order) const
+    {
+        const OwnerId account = order.GetOwner();
+        if (account >= accounts_.size() || !accounts_[account].configured_)
+            return RiskCheck::UnknownAccount;
+
+        const RiskLimits& limits = limits_[account];
+        const AccountState& state = accounts_[account];
+        const std::int64_t quantity = order.GetRemainingQuantity();
+        if (order.GetRemainingQuantity() > limits.maxOrderQuantity_)
+            return RiskCheck::OrderQuantity;
+        if (std::abs(static_cast<std::int64_t>(order.GetPrice())) * quantity > limits.maxNotional_)
+            return RiskCheck::Notional;
+        if (state.openOrders_ + 1 > limits.maxOpenOrders_)
+            return RiskCheck::OpenOrders;
+        if (std::abs(state.position_) + state.openBuyQuantity_ + state.openSellQuantity_ + quantity > limits.maxGrossPosition_)
+            return RiskCheck::GrossPosition;
+        const std::int64_t worstNet = order.GetSide() == Side::Buy
+            ? state.position_ + state.openBuyQuantity_ + quantity
+            : -(state.position_ - state.openSellQuantity_ - quantity);
+        if (worstNet > limits.maxNetPosition_)
+            return RiskCheck::NetPosition;
+        return RiskCheck::Accepted;
+    }
+
+    //Check and forward. Book must have this gate as its listener so the counters follow what happens to the order
+    template <typename Book>
+    Trades Submit(Book& orderbook, OrderPointer order, RiskCheck* result = nullptr)
+    {
+        const RiskCheck check = Check(*order);
+        if (result)
+            *result = check;
+        if (check != RiskCheck::Accepted)
+            return { };
+        return orderbook.AddOrder(order);
+    }
+
+    std::int64_t GetPosition(OwnerId account) const { return accounts_.at(account).position_; }
+    std::uint32_t GetOpenOrders(OwnerId account) const { return accounts_.at(account).openOrders_; }
+
+    //Orders can reach the book without Submit (direct AddOrder, spread legs, replicated commands). Owners outside the table are not tracked
+    void OnOrderAdded(const Order& order) override
+    {
+        AccountState* state = Find(order);
+        if (!state)
+            return;
+        ++state->openOrders_;
+        OpenQuantity(*state, order.GetSide()) += order.GetRemainingQuantity();
+    }
+
+    void OnOrderFilled(const Order& order, Price, Quantity quantity) override
+    {
+        AccountState* state = Find(order);
+        if (!state)
+            return;
+        OpenQuantity(*state, order.GetSide()) -= quantity;
+        state->position_ += order.GetSide() == Side::Buy ? std::int64_t{ quantity } : -std::int64_t{ quantity };
+        if (order.isFilled())
+            --state->openOrders_;
+    }
+
+    void OnOrderDecremented(const Order& order, Quantity quantity) override
+    {
+        if (AccountState* state = Find(order))
+            OpenQuantity(*state, order.GetSide()) -= quantity;
+    }
+
+    void OnOrderCancelled(const Order& order) override
+    {
+        AccountState* state = Find(order);
+        if (!state)
+            return;
+        --state->openOrders_;
+        OpenQuantity(*state, order.GetSide()) -= order.GetRemainingQuantity();
+    }
+
+    void OnLevelDeleted(Side, Price, const PriceLevel& level) override
+    {
+        for (const auto& order : level.orders_)
+            OnOrderCancelled(*order);
+        for (const auto& order : level.hidden_)
+            OnOrderCancelled(*order);
+    }
+
+private:
+    struct AccountState
+    {
+        std::uint32_t openOrders_{ 0 };
+        std::int64_t openBuyQuantity_{ 0 };
+        std::int64_t openSellQuantity_{ 0 };
+        std::int64_t position_{ 0 };
+        bool configured_{ false };
+    };
+
+    static std::int64_t& OpenQuantity(AccountState& state, Side side)
+    {
+        return side == Side::Buy ? state.openBuyQuantity_ : state.openSellQuantity_;
+    }
+
+    AccountState* Find(const Order& order)
+    {
+        return order.GetOwner() < accounts_.size() ? &accounts_[order.GetOwner()] : nullptr;
+    }
+
+    std::vector<RiskLimits> limits_;
+    std::vector<AccountState> accounts_;
+};
+
+//Books a calendar spread coordinator links. Spread is bought as buy near, sell far
+enum class SpreadLeg : std::uint8_t
+{
+    Near,
+    Far,
+    Spread
+};
+
+//Implied liquidity between a near outright, a far outright and their spread. All traffic for the three books goes through here
+//Implied in: spread bid/ask from the outrights. Implied out: each outright from the spread and the other outright
+//Implied orders are plain resting orders of our owner, priced off the real tops (own implied orders taken out). When one is hit,
+//the two tops it came from are traded right away with fill and kill orders, which leaves us flat
+//Tops are cached. After an event only books whose real top moved cause the implied orders fed by them to be replaced
+template <typename Book>
+class SpreadCoordinator
+{
+public:
+    //Own orders get ids counting up from firstOrderId, keep that range clear of client ids
+    SpreadCoordinator(Book& nearBook, Book& farBook, Book& spreadBook, OwnerId owner, OrderId firstOrderId)
+    : books_{ &nearBook, &farBook, &spreadBook }
+    , owner_{ owner }
+    , nextOrderId_{ firstOrderId }
+    {
+        Trades trades;
+        Settle({ true, true, true }, trades);
+    }
+
+    SpreadCoordinator(const SpreadCoordinator&) = delete;
+    SpreadCoordinator& operator=(const SpreadCoordinator&) = delete;
+
+    //Returned trades include any implied executions and their legs
+    Trades AddOrder(SpreadLeg leg, OrderPointer order)
+    {
+        Trades trades = books_[Index(leg)]->AddOrder(order);
+        Settle(Touched(leg), trades);
+        return trades;
+    }
+
+    Trades MatchOrder(SpreadLeg leg, OrderModify order)
+    {
+        Trades trades = books_[Index(leg)]->MatchOrder(order);
+        Settle(Touched(leg), trades);
+        return trades;
+    }
+
+    void CancelOrder(SpreadLeg leg, OrderId orderId)
+    {
+        books_[Index(leg)]->CancelOrder(orderId);
+        Trades trades;
+        Settle(Touched(leg), trades);
+    }
+
+    //Implied order we have out on one side of a book, if any
+    std::optional<LevelInfo> GetImplied(SpreadLeg leg, Side side) const
+    {
+        const Implied& implied = instruments_[Index(leg)].implied_[Index(side)];
+        if (implied.quantity_ == 0)
+            return std::nullopt;
+        return LevelInfo{ implied.price_, implied.quantity_ };
+    }
+
+    //Leg quantity that could not be traded after an implied fill (band, self-trade prevention). That much is left as open position
+    std::uint64_t GetUnhedgedQuantity() const { return unhedged_; }
+
+private:
+    struct Implied
+    {
+        OrderId orderId_{ 0 };
+        Price price_{ 0 };
+        Quantity quantity_{ 0 }; //Remaining. Zero means nothing is out
+    };
+
+    struct Instrument
+    {
+        std::array<std::optional<LevelInfo>, 2> tops_; //Real best bid and ask, our implied orders taken out
+        std::array<Implied, 2> implied_;
+        bool stale_{ false }; //Implied orders were pulled, put them back even if no input moved
+    };
+
+    //Which top of which book an implied order is built from
+    struct Input
+    {
+        SpreadLeg leg_;
+        Side side_;
+    };
+
+    using Books = std::array<bool, 3>;
+
+    static std::size_t Index(SpreadLeg leg) { return static_cast<std::size_t>(leg); }
+    static std::size_t Index(Side side) { return side == Side::Buy ? 0 : 1; }
+    static Side Opposite(Side side) { return side == Side::Buy ? Side::Sell : Side::Buy; }
+    static Books Touched(SpreadLeg leg)
+    {
+        Books books{ };
+        books[Index(leg)] = true;
+        return books;
+    }
+
+    //Spread bid = near bid - far ask, near bid = spread bid + far bid, far bid = near bid - spread ask. Asks mirror that
+    //Implied price is first top + second top for the near leg, first - second otherwise
+    static std::array<Input, 2> Inputs(SpreadLeg leg, Side side)
+    {
+        switch (leg)
+        {
+        case SpreadLeg::Spread:
+            return { Input{ SpreadLeg::Near, side }, Input{ SpreadLeg::Far, Opposite(side) } };
+        case SpreadLeg::Near:
+            return { Input{ SpreadLeg::Spread, side }, Input{ SpreadLeg::Far, side } };
+        default:
+            return { Input{ SpreadLeg::Near, side }, Input{ SpreadLeg::Spread, Opposite(side) } };
+        }
+    }
+
+    const std::optional<LevelInfo>& Top(const Input& input) const { return instruments_[Index(input.leg_)].tops_[Index(input.side_)]; }
+
+    //Best level without our own implied order in it
+    std::optional<LevelInfo> RealTop(SpreadLeg leg, Side side) const
+    {
+        const Implied& implied = instruments_[Index(leg)].implied_[Index(side)];
+        for (LevelInfo level : books_[Index(leg)]->GetTopLevels(side, 2)) //Our order is at most one level deep
+        {
+            if (implied.quantity_ > 0 && level.price_ == implied.price_)
+                level.quantity_ -= implied.quantity_;
+            if (level.quantity_ > 0)
+                return level;
+        }
+        return std::nullopt;
+    }
+
+    //Re-read tops of one book, true if anything moved
+    bool RefreshTops(SpreadLeg leg)
+    {
+        bool moved = false;
+        for (Side side : { Side::Buy, Side::Sell })
+        {
+            auto top = RealTop(leg, side);
+            auto& cached = instruments_[Index(leg)].tops_[Index(side)];
+            const bool same = top.has_value() == cached.has_value() && (!top || (top->price_ == cached->price_ && top->quantity_ == cached->quantity_));
+            moved |= !same;
+            cached = top;
+        }
+        return moved;
+    }
+
+    void Withdraw(SpreadLeg leg)
+    {
+        Instrument& instrument = instruments_[Index(leg)];
+        for (Implied& implied : instrument.implied_)
+        {
+            if (implied.quantity_ > 0)
+                books_[Index(leg)]->CancelOrder(implied.orderId_);
+            implied.quantity_ = 0;
+        }
+        instrument.stale_ = true;
+    }
+
+    //Implied order of ours was hit. Trade the two tops it was built from so we end up flat
+    void ExecuteLegs(SpreadLeg leg, Side side, Quantity quantity, Trades& trades, Books& touched)
+    {
+        for (const Input& input : Inputs(leg, side))
+        {
+            const Price price = Top(input)->price_;
+            Withdraw(input.leg_); //Our own implied order there must not take the fill
+            auto order = books_[Index(input.leg_)]->MakeOrder(OrderType::FillandKill, nextOrderId_++, Opposite(input.side_), price, quantity);
+            order->SetOwner(owner_);
+            auto legTrades = books_[Index(input.leg_)]->AddOrder(order);
+            unhedged_ += order->GetRemainingQuantity();
+            trades.insert(trades.end(), legTrades.begin(), legTrades.end());
+            touched[Index(input.leg_)] = true;
+        }
+    }
+
+    //What the inputs give for one side of a book right now. Zero quantity if an input is missing
+    Implied Derive(SpreadLeg leg, Side side) const
+    {
+        const auto inputs = Inputs(leg, side);
+        const auto& first = Top(inputs[0]);
+        const auto& second = Top(inputs[1]);
+        if (!first || !second)
+            return { };
+        //Onto this book's tick, rounded in our favour. Legs still trade at their own tops
+        const Price price = leg == SpreadLeg::Near ? first->price_ + second->price_ : first->price_ - second->price_;
+        const PriceSpec& priceSpec = books_[Index(leg)]->GetPriceSpec();
+        return Implied{ 0, side == Side::Buy ? priceSpec.RoundDown(price) : priceSpec.RoundUp(price), std::min(first->quantity_, second->quantity_) };
+    }
+
+    //Replace whichever implied orders of a book no longer match their inputs. Both stale ones are pulled before either goes back in,
+    //so a new bid can never meet our own old ask. A new implied order that crosses trades
+    void Publish(SpreadLeg leg, Trades& trades, Books& touched)
+    {
+        std::array<Implied, 2> wanted{ Derive(leg, Side::Buy), Derive(leg, Side::Sell) };
+        std::array<bool, 2> replace{ };
+        for (std::size_t side = 0; side < 2; ++side)
+        {
+            Implied& implied = instruments_[Index(leg)].implied_[side];
+            if (implied.quantity_ == wanted[side].quantity_ && (implied.quantity_ == 0 || implied.price_ == wanted[side].price_))
+                continue;
+            if (implied.quantity_ > 0)
+                books_[Index(leg)]->CancelOrder(implied.orderId_);
+            implied = Implied{ };
+            replace[side] = wanted[side].quantity_ > 0;
+        }
+
+        for (std::size_t side = 0; side < 2; ++side)
+        {
+            if (!replace[side])
+                continue;
+            Implied& implied = instruments_[Index(leg)].implied_[side];
+            implied = Implied{ nextOrderId_++, wanted[side].price_, wanted[side].quantity_ };
+            auto order = books_[Index(leg)]->MakeOrder(OrderType::GoodTillCancel, implied.orderId_, side == 0 ? Side::Buy : Side::Sell, implied.price_, implied.quantity_);
+            order->SetOwner(owner_);
+            auto published = books_[Index(leg)]->AddOrder(order);
+            if (!published.empty())
+            {
+                trades.insert(trades.end(), published.begin(), published.end());
+                touched[Index(leg)] = true;
+            }
+        }
+    }
+
+    //Loop until nothing moves: implied fills trade their legs, moved tops replace the implied orders they feed, and a
+    //replaced implied order that crosses trades again. A publish that trades ends the pass, tops are read again before the next one
+    void Settle(Books touched, Trades& trades)
+    {
+        std::size_t seen = 0;
+        Books pending{ };
+        while (true)
+        {
+            for (; seen < trades.size(); ++seen)
+            {
+                for (const TradeInfo& info : { trades[seen].GetBidTrade(), trades[seen].GetAskTrade() })
+                {
+                    for (std::size_t leg = 0; leg < instruments_.size(); ++leg)
+                    {
+                        for (std::size_t side = 0; side < 2; ++side)
+                        {
+                            Implied& implied = instruments_[leg].implied_[side];
+                            if (implied.quantity_ == 0 || implied.orderId_ != info.orderId_)
+                                continue;
+                            implied.quantity_ -= info.quantity_;
+                            ExecuteLegs(static_cast<SpreadLeg>(leg), side == 0 ? Side::Buy : Side::Sell, info.quantity_, trades, touched);
+                        }
+                    }
+                }
+            }
+
+            //Each book's implied orders come from the other two
+            for (std::size_t leg = 0; leg < instruments_.size(); ++leg)
+            {
+                if (touched[leg] && RefreshTops(static_cast<SpreadLeg>(leg)))
+                    pending[(leg + 1) % 3] = pending[(leg + 2) % 3] = true;
+                if (instruments_[leg].stale_)
+                    pending[leg] = true;
+                instruments_[leg].stale_ = false;
+            }
+            touched = { };
+
+            for (std::size_t leg = 0; leg < instruments_.size() && touched == Books{ }; ++leg)
+            {
+                if (!pending[leg])
+                    continue;
+                Publish(static_cast<SpreadLeg>(leg), trades, touched);
+                pending[leg] = false;
+            }
+
+            if (seen == trades.size() && touched == Books{ } && pending == Books{ })
+                break;
+        }
+    }
+
+    std::array<Book*, 3> books_;
+    std::array<Instrument, 3> instruments_;
+    OwnerId owner_;
+    OrderId nextOrderId_;
+    std::uint64_t unhedged_{ 0 };
+};
+
+//Replication. The primary stamps every command it applies with a sequence number and publishes it. A standby in
+//another process applies the same commands to its own book, which keeps it in the same state without a replay
+enum class CommandType : std::uint8_t
+{
+    Add,
+    Cancel,
+    Modify,
+    CancelAll,
+    CancelSide,
+    CancelRange,
+    AdvanceTime,
+    EndSession,
+    StartAuction,
+    Uncross,
+    AddTrailingStop,
+    CancelTrailingStop,
+    Checkpoint //Primary's book checksum after everything before it. Standby compares its own
+};
+
+//Flat and fixed size so it can be copied through shared memory. Each command type only uses the fields it needs
+struct BookCommand
+{
+    std::uint64_t sequence_{ 0 };
+    OrderId orderId_{ 0 };
+    Timestamp time_{ 0 }; //Expiry for Add, clock for AdvanceTime/EndSession
+    std::uint64_t checksum_{ 0 };
+    Price price_{ 0 }; //Low end for CancelRange, reference for Uncross
+    Price highPrice_{ 0 };
+    Price pegOffset_{ 0 };
+    Quantity quantity_{ 0 };
+    Quantity displayQuantity_{ 0 };
+    Quantity minimumQuantity_{ 0 };
+    OwnerId owner_{ 0 };
+    TrailingOffset trailingOffset_{ }; //AddTrailingStop only
+    CommandType type_{ CommandType::Add };
+    OrderType orderType_{ OrderType::GoodTillCancel };
+    Side side_{ Side::Buy };
+    std::uint8_t attributes_{ 0 };
+    PegReference pegReference_{ PegReference::Primary };
+    bool hasPrice_{ false }; //Uncross with a reference price
+
+    //Everything needed to rebuild the order as it was submitted. Take it before AddOrder, the book can reprice and fill it
+    static BookCommand FromOrder(const Order& order)
+    {
+        BookCommand command;
+        command.type_ = CommandType::Add;
+        command.orderId_ = order.GetOrderId();
+        command.orderType_ = order.GetOrderType();
+        command.side_ = order.GetSide();
+        command.price_ = order.GetPrice();
+        command.quantity_ = order.GetRemainingQuantity();
+        command.displayQuantity_ = order.GetDisplayQuantity();
+        command.minimumQuantity_ = order.GetMinimumQuantity();
+        command.time_ = order.GetExpiry();
+        command.owner_ = order.GetOwner();
+        command.attributes_ = static_cast<std::uint8_t>(order.GetAttributes());
+        command.pegReference_ = order.GetPegReference();
+        command.pegOffset_ = order.GetPegOffset();
+        return command;
+    }
+
+    //From the book's memory when it has an arena, see BasicOrderbook::GetMemoryResource
+    OrderPointer ToOrder(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) const
+    {
+        auto order = std::allocate_shared<Order>(std::pmr::polymorphic_allocator<Order>{ memory }, orderType_, orderId_, side_, price_, quantity_, displayQuantity_);
+        order->SetExpiry(time_);
+        order->SetOwner(owner_);
+        order->AddAttributes(static_cast<OrderAttribute>(attributes_));
+        if (order->HasAttribute(OrderAttribute::MinimumQuantity))
+            order->SetMinimumQuantity(minimumQuantity_);
+        if (order->IsPegged())
+            order->SetPeg(pegReference_, pegOffset_);
+        return order;
+    }
+};
+
+//Primary and standby both go through this, so a command does exactly the same thing on both books
+template <typename Book>
+Trades ApplyCommand(Book& orderbook, const BookCommand& command)
+{
+    switch (command.type_)
+    {
+    case CommandType::Add:
+        return orderbook.AddOrder(command.ToOrder(orderbook.GetMemoryResource()));
+    case CommandType::Cancel:
+        orderbook.CancelOrder(command.orderId_);
+        return { };
+    case CommandType::Modify:
+        return orderbook.MatchOrder(OrderModify(command.orderId_, command.side_, command.price_, command.quantity_));
+    case CommandType::CancelAll:
+        orderbook.CancelAll(command.owner_);
+        return { };
+    case CommandType::CancelSide:
+        orderbook.CancelSide(command.side_);
+        return { };
+    case CommandType::CancelRange:
+        orderbook.CancelRange(command.side_, command.price_, command.highPrice_);
+        return { };
+    case CommandType::AdvanceTime:
+        orderbook.AdvanceTime(command.time_);
+        return { };
+    case CommandType::EndSession:
+        orderbook.EndSession(command.time_);
+        return { };
+    case CommandType::StartAuction:
+        orderbook.StartAuction();
+        return { };
+    case CommandType::Uncross:
+        return orderbook.Uncross(command.hasPrice_ ? std::optional<Price>{ command.price_ } : std::nullopt);
+    case CommandType::AddTrailingStop:
+        orderbook.AddTrailingStop(command.ToOrder(orderbook.GetMemoryResource()), command.trailingOffset_);
+        return { };
+    case CommandType::CancelTrailingStop:
+        orderbook.CancelTrailingStop(command.orderId_);
+        return { };
+    case CommandType::Checkpoint:
+        return { };
+    }
+    return { };
+}
+
+//Single producer single consumer ring of commands laid out in one block of memory, header first and slots after it
+//No pointers inside, so the block can be mapped at a different address in each process
+class CommandRing
+{
+public:
+    static std::size_t BytesFor(std::size_t capacity) { return sizeof(CommandRing) + capacity * sizeof(BookCommand); }
+
+    //Builds an empty ring in memory of at least BytesFor(capacity). Capacity must be a power of two
+    static CommandRing* Create(void* memory, std::size_t capacity)
+    {
+        if (capacity == 0 || !std::has_single_bit(capacity))
+            throw std::logic_error("Ring capacity must be a power of two");
+        return new (memory) CommandRing(capacity);
+    }
+
+    //Ring someone else created in memory this process has mapped too
+    static CommandRing* Attach(void* memory) { return static_cast<CommandRing*>(memory); }
+
+    //Never waits. False if the ring is full, the command is lost and the reader will see a gap in the sequence
+    bool TryPush(const BookCommand& command)
+    {
+        const std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cachedHead_ > mask_)
+        {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (tail - cachedHead_ > mask_)
+                return false;
+        }
+        Slots()[tail & mask_] = command;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(BookCommand& command)
+    {
+        const std::uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head == cachedTail_)
+        {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (head == cachedTail_)
+                return false;
+        }
+        command = Slots()[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::size_t GetBacklog() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+    std::size_t GetCapacity() const { return mask_ + 1; }
+
+    //Primary is done (or stepping down). Standby takes it as the signal to drain and promote
+    void Close() { closed_.store(true, std::memory_order_release); }
+    bool IsClosed() const { return closed_.load(std::memory_order_acquire); }
+
+private:
+    explicit CommandRing(std::size_t capacity)
+    : mask_{ capacity - 1 }
+    { }
+
+    BookCommand* Slots() { return reinterpret_cast<BookCommand*>(this + 1); }
+
+    static_assert(std::is_trivially_copyable_v<BookCommand>);
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Ring atomics must work across processes");
+
+    //Writer and reader each on their own cache line, each with a cached copy of the other's index
+    alignas(64) std::atomic<std::uint64_t> tail_{ 0 };
+    std::uint64_t cachedHead_{ 0 };
+    alignas(64) std::atomic<std::uint64_t> head_{ 0 };
+    std::uint64_t cachedTail_{ 0 };
+    alignas(64) std::uint64_t mask_;
+    std::atomic<bool> closed_{ false };
+};
+
+//Memory another process can map. Named segments go through shm_open so any process can open them,
+//an empty name gives an anonymous mapping that is shared with children across fork
+class SharedMemory
+{
+public:
+    //Creating with a node prefers it for the segment's pages, see PlanShards
+    SharedMemory(std::size_t bytes, const std::string& name = { }, bool create = true, std::optional<int> node = std::nullopt)
+    : name_{ name }
+    , bytes_{ bytes }
+    , owner_{ create && !name.empty() }
+    {
+        int descriptor = -1;
+        if (!name_.empty())
+        {
+            descriptor = shm_open(name_.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+            if (descriptor < 0 || (create && ftruncate(descriptor, static_cast<off_t>(bytes_)) != 0))
+            {
+                if (descriptor >= 0)
+                    close(descriptor);
+                if (owner_)
+                    shm_unlink(name_.c_str());
+                throw std::runtime_error("Cannot open shared memory " + name_);
+            }
+        }
+        const int flags = name_.empty() ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED;
+        memory_ = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, flags, descriptor, 0);
+        if (descriptor >= 0)
+            close(descriptor); //Mapping keeps the segment alive
+        if (memory_ == MAP_FAILED)
+        {
+            if (owner_)
+                shm_unlink(name_.c_str());
+            throw std::runtime_error("Cannot map shared memory");
+        }
+        if (create && node)
+            BindToNode(memory_, bytes_, *node);
+    }
+
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    ~SharedMemory()
+    {
+        munmap(memory_, bytes_);
+        if (owner_)
+            shm_unlink(name_.c_str());
+    }
+
+    void* Get() const { return memory_; }
+
+private:
+    std::string name_;
+    std::size_t bytes_;
+    bool owner_;
+    void* memory_{ nullptr };
+};
+
+//Front of the primary book. Every command is sequenced, published and then applied, with a checkpoint every checkpointInterval commands
+//Publishing never blocks matching: if the standby falls a full ring behind, commands are dropped and it sees the gap
+template <typename Book>
+class ReplicationPrimary
+{
+public:
+    ReplicationPrimary(Book& orderbook, CommandRing& ring, std::uint64_t checkpointInterval = 1024)
+    : orderbook_{ orderbook }
+    , ring_{ ring }
+    , checkpointInterval_{ checkpointInterval }
+    { }
+
+    Trades AddOrder(OrderPointer order)
+    {
+        BookCommand command = BookCommand::FromOrder(*order);
+        Publish(command);
+        return Finish(orderbook_.AddOrder(order)); //Caller's own order object, so it can still look at it
+    }
+
+    Trades Submit(BookCommand command)
+    {
+        Publish(command);
+        return Finish(ApplyCommand(orderbook_, command));
+    }
+
+    void CancelOrder(OrderId orderId)
+    {
+        BookCommand command;
+        command.type_ = CommandType::Cancel;
+        command.orderId_ = orderId;
+        Submit(command);
+    }
+
+    Trades MatchOrder(OrderModify order)
+    {
+        BookCommand command;
+        command.type_ = CommandType::Modify;
+        command.orderId_ = order.GetOrderId();
+        command.side_ = order.GetSide();
+        command.price_ = order.GetPrice();
+        command.quantity_ = order.GetQuantity();
+        return Submit(command);
+    }
+
+    //Stops change the book later, when a trade triggers them, so the standby has to be holding the same ones
+    bool AddTrailingStop(OrderPointer order, TrailingOffset offset)
+    {
+        BookCommand command = BookCommand::FromOrder(*order);
+        command.type_ = CommandType::AddTrailingStop;
+        command.trailingOffset_ = offset;
+        Publish(command);
+        const bool added = orderbook_.AddTrailingStop(order, offset);
+        Finish({ });
+        return added;
+    }
+
+    bool CancelTrailingStop(OrderId orderId)
+    {
+        BookCommand command;
+        command.type_ = CommandType::CancelTrailingStop;
+        command.orderId_ = orderId;
+        Publish(command);
+        const bool cancelled = orderbook_.CancelTrailingStop(orderId);
+        Finish({ });
+        return cancelled;
+    }
+
+    //Out of band checkpoint, e.g. right before stepping down
+    void Checkpoint()
+    {
+        BookCommand command;
+        command.type_ = CommandType::Checkpoint;
+        command.checksum_ = orderbook_.GetChecksum();
+        Publish(command);
+        sinceCheckpoint_ = 0;
+    }
+
+    std::uint64_t GetSequence() const { return sequence_; }
+    std::uint64_t GetDroppedCount() const { return dropped_; }
+
+private:
+    void Publish(BookCommand& command)
+    {
+        command.sequence_ = ++sequence_;
+        if (!ring_.TryPush(command)) [[unlikely]]
+            ++dropped_;
+    }
+
+    Trades Finish(Trades trades)
+    {
+        if (++sinceCheckpoint_ >= checkpointInterval_)
+            Checkpoint();
+        return trades;
+    }
+
+    Book& orderbook_;
+    CommandRing& ring_;
+    std::uint64_t checkpointInterval_;
+    std::uint64_t sinceCheckpoint_{ 0 };
+    std::uint64_t sequence_{ 0 };
+    std::uint64_t dropped_{ 0 };
+};
+
+enum class ReplicaState
+{
+    Following, //Every command so far applied and every checkpoint matched
+    Gap, //A sequence number was skipped. Book is no longer a copy, nothing more is applied
+    Diverged //Checksum did not match at a checkpoint
+};
+
+//Standby side. Owns its book and applies the ring's commands in sequence. Book has to be set up like the primary's
+//(price spec, self-trade prevention, band) before the first command. Promote hands the book over once the ring is drained
+template <typename Book>
+class ReplicationStandby
+{
+public:
+    ReplicationStandby(CommandRing& ring, const PriceSpec& priceSpec = PriceSpec{})
+    : ring_{ ring }
+    , orderbook_{ priceSpec }
+    { }
+
+    //Apply up to limit commands waiting in the ring. Returns how many were taken off it
+    std::size_t Poll(std::size_t limit = std::numeric_limits<std::size_t>::max())
+    {
+        std::size_t polled = 0;
+        BookCommand command;
+        while (polled < limit && ring_.TryPop(command))
+        {
+            ++polled;
+            if (state_ != ReplicaState::Following)
+                continue; //Drain so the primary never backs up behind a dead replica
+            if (command.sequence_ != sequence_ + 1) [[unlikely]]
+            {
+                state_ = ReplicaState::Gap;
+                gapFrom_ = sequence_ + 1;
+                continue;
+            }
+            sequence_ = command.sequence_;
+            if (command.type_ == CommandType::Checkpoint)
+            {
+                if (command.checksum_ != orderbook_.GetChecksum())
+                    state_ = ReplicaState::Diverged;
+                else
+                    verifiedSequence_ = sequence_;
+                continue;
+            }
+            ApplyCommand(orderbook_, command);
+        }
+        return polled;
+    }
+
+    //Drains what the primary got out, then the book is ours. nullptr if this replica cannot be trusted
+    Book* Promote()
+    {
+        while (Poll() != 0)
+            ;
+        return state_ == ReplicaState::Following ? &orderbook_ : nullptr;
+    }
+
+    ReplicaState GetState() const { return state_; }
+    std::uint64_t GetSequence() const { return sequence_; }
+    std::uint64_t GetVerifiedSequence() const { return verifiedSequence_; }
+    std::uint64_t GetGapStart() const { return gapFrom_; } //First missing sequence once in Gap
+    const Book& GetOrderbook() const { return orderbook_; }
+    Book& GetOrderbook() { return orderbook_; } //Setup only. Anything done to the book outside the command stream breaks the copy
+
+private:
+    CommandRing& ring_;
+    Book orderbook_;
+    ReplicaState state_{ ReplicaState::Following };
+    std::uint64_t sequence_{ 0 };
+    std::uint64_t verifiedSequence_{ 0 };
+    std::uint64_t gapFrom_{ 0 };
+};
+
+//Nanosecond latencies in power of two buckets. One thread records, any thread can read
+class LatencyHistogram
+{
+public:
+    void Record(Timestamp nanoseconds)
+    {
+        Increment(buckets_[std::bit_width(nanoseconds)], 1);
+        Increment(count_, 1);
+        Increment(total_, nanoseconds);
+        if (nanoseconds > max_.load(std::memory_order_relaxed))
+            max_.store(nanoseconds, std::memory_order_relaxed);
+    }
+
+    std::uint64_t GetCount() const { return count_.load(std::memory_order_relaxed); }
+    Timestamp GetMax() const { return max_.load(std::memory_order_relaxed); }
+    double GetMean() const
+    {
+        const std::uint64_t count = GetCount();
+        return count ? static_cast<double>(total_.load(std::memory_order_relaxed)) / count : 0.0;
+    }
+
+    //Upper edge of the bucket holding that fraction of samples, so within a factor of two
+    Timestamp GetPercentile(double fraction) const
+    {
+        const auto wanted = static_cast<std::uint64_t>(std::ceil(fraction * GetCount()));
+        std::uint64_t seen = 0;
+        for (std::size_t bucket = 0; bucket < buckets_.size(); ++bucket)
+        {
+            seen += buckets_[bucket].load(std::memory_order_relaxed);
+            if (seen >= wanted && seen > 0)
+                return bucket == 0 ? 0 : (bucket >= 64 ? std::numeric_limits<Timestamp>::max() : (Timestamp{ 1 } << bucket) - 1);
+        }
+        return 0;
+    }
+
+private:
+    //Single writer, so a plain load and store instead of a locked add
+    static void Increment(std::atomic<std::uint64_t>& counter, std::uint64_t amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<std::uint64_t>, 65> buckets_{ }; //Bucket b holds [2^(b-1), 2^b)
+    std::atomic<std::uint64_t> count_{ 0 };
+    std::atomic<std::uint64_t> total_{ 0 };
+    std::atomic<Timestamp> max_{ 0 };
+};
+
+//Cancels and kill switches for one book, posted from any thread without taking a lock and applied by the thread that owns
+//the book, ahead of its normal flow. Bounded ring where each slot carries the sequence it is ready for (Vyukov), so
+//producers only contend on one CAS of the tail. Every request is stamped when posted and again once it has been applied
+//A cancel that overtakes the add it targets finds nothing to cancel; kill switches should go through CancelAll(owner)
+//together with stopping the owner's new orders upstream, e.g. zeroed RiskGate limits
+class CancelQueue
+{
+public:
+    explicit CancelQueue(std::size_t capacity = 1024)
+    : slots_(std::bit_ceil(std::max<std::size_t>(capacity, 2)))
+    , mask_{ slots_.size() - 1 }
+    {
+        for (std::size_t slot = 0; slot < slots_.size(); ++slot)
+            slots_[slot].sequence_.store(slot, std::memory_order_relaxed);
+    }
+
+    //Any thread. False when the ring is full
+    bool TryCancel(OrderId orderId)
+    {
+        BookCommand command;
+        command.type_ = CommandType::Cancel;
+        command.orderId_ = orderId;
+        return TryPost(command);
+    }
+    bool TryCancelAll(OwnerId owner)
+    {
+        BookCommand command;
+        command.type_ = CommandType::CancelAll;
+        command.owner_ = owner;
+        return TryPost(command);
+    }
+    bool TryCancelSide(Side side)
+    {
+        BookCommand command;
+        command.type_ = CommandType::CancelSide;
+        command.side_ = side;
+        return TryPost(command);
+    }
+    bool TryCancelRange(Side side, Price low, Price high)
+    {
+        BookCommand command;
+        command.type_ = CommandType::CancelRange;
+        command.side_ = side;
+        command.price_ = low;
+        command.highPrice_ = high;
+        return TryPost(command);
+    }
+
+    //Owning thread only. Cheap enough to call before every normal command
+    bool IsEmpty() const { return slots_[head_ & mask_].sequence_.load(std::memory_order_acquire) != head_ + 1; }
+
+    //Owning thread only. Applies everything posted so far, returns how many
+    template <typename Book>
+    std::size_t Drain(Book& orderbook)
+    {
+        std::size_t drained = 0;
+        for (;;)
+        {
+            Slot& slot = slots_[head_ & mask_];
+            if (slot.sequence_.load(std::memory_order_acquire) != head_ + 1)
+                return drained;
+            const BookCommand command = slot.command_;
+            const Timestamp postedAt = slot.postedAt_;
+            slot.sequence_.store(head_ + slots_.size(), std::memory_order_release); //Free for the producer one lap ahead
+            ++head_;
+
+            ApplyCommand(orderbook, command);
+            const Timestamp now = TscClock::Get().Now();
+            latency_.Record(now > postedAt ? now - postedAt : 0);
+            ++drained;
+        }
+    }
+
+    //Post to applied, per request
+    const LatencyHistogram& GetLatency() const { return latency_; }
+    std::uint64_t GetRejectedCount() const { return rejected_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<std::uint64_t> sequence_{ 0 }; //position: free for the producer at position, position + 1: ready to drain
+        BookCommand command_;
+        Timestamp postedAt_{ 0 };
+    };
+
+    bool TryPost(const BookCommand& command)
+    {
+        std::uint64_t position = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[position & mask_];
+            const auto difference = static_cast<std::int64_t>(slot.sequence_.load(std::memory_order_acquire) - position);
+            if (difference == 0)
+            {
+                if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (difference < 0) //Still holds a request from one lap back, full
+            {
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+                position = tail_.load(std::memory_order_relaxed); //Another producer took it
+        }
+        Slot& slot = slots_[position & mask_];
+        slot.command_ = command;
+        slot.postedAt_ = TscClock::Get().Now();
+        slot.sequence_.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::vector<Slot> slots_;
+    std::size_t mask_;
+    alignas(64) std::atomic<std::uint64_t> tail_{ 0 };
+    std::atomic<std::uint64_t> rejected_{ 0 };
+    alignas(64) std::uint64_t head_{ 0 }; //Owning thread only
+    LatencyHistogram latency_;
+};
+
+//Chase-Lev deque of task ids. The owning worker pushes and pops at the bottom, any other thread steals from the top
+//Fixed capacity, which is enough for the executor below: a symbol is queued in at most one place at a time
+class WorkStealingDeque
+{
+public:
+    explicit WorkStealingDeque(std::size_t capacity)
+    : tasks_(std::bit_ceil(std::max<std::size_t>(capacity, 2)))
+    , mask_{ static_cast<std::int64_t>(tasks_.size()) - 1 }
+    { }
+
+    //Owner only
+    void Push(std::uint32_t task)
+    {
+        const std::int64_t bottom = bottom_.load(std::memory_order_relaxed);
+        tasks_[bottom & mask_].store(task, std::memory_order_relaxed);
+        bottom_.store(bottom + 1, std::memory_order_release);
+    }
+
+    //Owner only. Newest first
+    std::optional<std::uint32_t> Pop()
+    {
+        const std::int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        bottom_.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t top = top_.load(std::memory_order_relaxed);
+        if (top > bottom)
+        {
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        const std::uint32_t task = tasks_[bottom & mask_].load(std::memory_order_relaxed);
+        if (top == bottom) //Last one, a thief may be after it too
+        {
+            const bool won = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+            if (!won)
+                return std::nullopt;
+        }
+        return task;
+    }
+
+    //Any thread. Oldest first
+    std::optional<std::uint32_t> Steal()
+    {
+        std::int64_t top = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const std::int64_t bottom = bottom_.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return std::nullopt;
+        const std::uint32_t task = tasks_[top & mask_].load(std::memory_order_relaxed);
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return std::nullopt; //Lost to the owner or another thief
+        return task;
+    }
+
+private:
+    std::vector<std::atomic<std::uint32_t>> tasks_;
+    std::int64_t mask_;
+    alignas(64) std::atomic<std::int64_t> top_{ 0 };
+    alignas(64) std::atomic<std::int64_t> bottom_{ 0 };
+};
+
+//Runs many books on a few worker threads. Each symbol has its own command queue and is one task that at most one worker
+//holds at a time, so a book sees its commands in the order they were posted. A worker runs its own tasks newest first,
+//the book it just ran is still in cache, and an idle worker steals the oldest task of another. With stealing off a symbol
+//always runs on worker symbol % workers, which is plain static sharding. Cancels posted through TryCancel go on the
+//symbol's CancelQueue and are applied before its next normal command
+template <typename Book>
+class SymbolExecutor
+{
+public:
+    //Called on the worker thread that applied the command
+    using TradeHandler = std::function<void(std::size_t symbol, const Trades& trades)>;
+
+    //cpus pins worker i to cpus[i % size], see PlanShards. Empty leaves placement to the scheduler
+    SymbolExecutor(std::size_t symbols, std::size_t workers, bool stealing = true, std::vector<int> cpus = { }, TradeHandler onTrades = { },
+        std::size_t cancelCapacity = 64)
+    : stealing_{ stealing }
+    , onTrades_{ std::move(onTrades) }
+    {
+        for (std::size_t symbol = 0; symbol < symbols; ++symbol)
+            symbols_.push_back(std::make_unique<Symbol>(cancelCapacity));
+        for (std::size_t worker = 0; worker < std::max<std::size_t>(workers, 1); ++worker)
+            workers_.push_back(std::make_unique<Worker>(symbols));
+        for (std::size_t worker = 0; worker < workers_.size(); ++worker)
+        {
+            workers_[worker]->thread_ = std::thread{ [this, worker, cpus]
+            {
+                if (!cpus.empty())
+                    PinCurrentThread(cpus[worker % cpus.size()]);
+                Run(worker);
+            } };
+        }
+    }
+
+    //Stops without finishing what is queued, Drain first for that
+    ~SymbolExecutor()
+    {
+        stopping_.store(true, std::memory_order_relaxed);
+        for (auto& worker : workers_)
+            worker->thread_.join();
+    }
+
+    SymbolExecutor(const SymbolExecutor&) = delete;
+    SymbolExecutor& operator=(const SymbolExecutor&) = delete;
+
+    //Any thread
+    void Post(std::size_t symbol, const BookCommand& command)
+    {
+        submitted_.fetch_add(1, std::memory_order_relaxed);
+        auto& entry = *symbols_[symbol];
+        bool schedule = false;
+        {
+            std::lock_guard lock{ entry.mutex_ };
+            entry.pending_.push_back(command);
+            schedule = !entry.scheduled_;
+            entry.scheduled_ = true;
+        }
+        if (schedule)
+            Schedule(symbol);
+    }
+
+    //Any thread. Jumps the symbol's queued flow. False when its cancel queue is full
+    bool TryCancel(std::size_t symbol, OrderId orderId)
+    {
+        submitted_.fetch_add(1, std::memory_order_relaxed); //Before the push, so completed can never run ahead
+        if (!symbols_[symbol]->cancels_.TryCancel(orderId))
+        {
+            submitted_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        Wake(symbol);
+        return true;
+    }
+
+    //Kill switch, every book. False if any queue was full, the rest still got it
+    bool TryCancelAll(OwnerId owner)
+    {
+        bool posted = true;
+        for (std::size_t symbol = 0; symbol < symbols_.size(); ++symbol)
+        {
+            submitted_.fetch_add(1, std::memory_order_relaxed);
+            if (symbols_[symbol]->cancels_.TryCancelAll(owner))
+                Wake(symbol);
+            else
+            {
+                submitted_.fetch_sub(1, std::memory_order_relaxed);
+                posted = false;
+            }
+        }
+        return posted;
+    }
+
+    //Read after Drain
+    const LatencyHistogram& GetCancelLatency(std::size_t symbol) const { return symbols_[symbol]->cancels_.GetLatency(); }
+
+    //Waits until everything posted so far, cancels included, has been applied. Books can be read after this, until the next Post
+    void Drain() const
+    {
+        while (completed_.load(std::memory_order_acquire) != submitted_.load(std::memory_order_relaxed))
+            std::this_thread::yield();
+    }
+
+    Book& GetOrderbook(std::size_t symbol) { return symbols_[symbol]->orderbook_; }
+    std::size_t GetWorkerCount() const { return workers_.size(); }
+    //Commands applied by one worker, to see how evenly the load spread
+    std::uint64_t GetAppliedCount(std::size_t worker) const { return workers_[worker]->applied_.load(std::memory_order_relaxed); }
+    std::uint64_t GetStealCount() const { return steals_.load(std::memory_order_relaxed); }
+
+private:
+    struct Symbol
+    {
+        explicit Symbol(std::size_t cancelCapacity)
+        : cancels_{ cancelCapacity }
+        { }
+
+        CancelQueue cancels_;
+        std::mutex mutex_;
+        std::vector<BookCommand> pending_; //Guarded by mutex_
+        bool scheduled_{ false }; //Queued or running somewhere. Guarded by mutex_
+        std::vector<BookCommand> running_; //Batch being applied, only touched by the worker holding the symbol
+        Book orderbook_;
+    };
+
+    struct Worker
+    {
+        explicit Worker(std::size_t symbols)
+        : deque_{ symbols }
+        { }
+
+        WorkStealingDeque deque_;
+        std::mutex inboxMutex_;
+        std::deque<std::uint32_t> inbox_; //Symbols that Post woke up
+        std::atomic<std::uint64_t> applied_{ 0 };
+        std::thread thread_;
+    };
+
+    //Was idle. Hand it to its home worker, anyone may steal it from there
+    void Schedule(std::size_t symbol)
+    {
+        auto& home = *workers_[symbol % workers_.size()];
+        std::lock_guard lock{ home.inboxMutex_ };
+        home.inbox_.push_back(static_cast<std::uint32_t>(symbol));
+    }
+
+    //After a cancel went on the queue. Only the scheduled flag needs the lock, the queue itself does not
+    void Wake(std::size_t symbol)
+    {
+        auto& entry = *symbols_[symbol];
+        bool schedule = false;
+        {
+            std::lock_guard lock{ entry.mutex_ };
+            schedule = !entry.scheduled_;
+            entry.scheduled_ = true;
+        }
+        if (schedule)
+            Schedule(symbol);
+    }
+
+    static std::optional<std::uint32_t> TakeInbox(Worker& worker)
+    {
+        std::lock_guard lock{ worker.inboxMutex_ };
+        if (worker.inbox_.empty())
+            return std::nullopt;
+        const std::uint32_t symbol = worker.inbox_.front();
+        worker.inbox_.pop_front();
+        return symbol;
+    }
+
+    std::optional<std::uint32_t> FindTask(Worker& worker, std::minstd_rand& random)
+    {
+        if (auto task = worker.deque_.Pop())
+            return task;
+        if (auto task = TakeInbox(worker))
+            return task;
+        if (!stealing_)
+            return std::nullopt;
+        const std::size_t start = random() % workers_.size();
+        for (std::size_t offset = 0; offset < workers_.size(); ++offset)
+        {
+            auto& victim = *workers_[(start + offset) % workers_.size()];
+            if (&victim == &worker)
+                continue;
+            auto task = victim.deque_.Steal();
+            if (!task)
+                task = TakeInbox(victim);
+            if (task)
+            {
+                steals_.fetch_add(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void Run(std::size_t index)
+    {
+        auto& worker = *workers_[index];
+        std::minstd_rand random{ static_cast<std::uint32_t>(index + 1) };
+        while (!stopping_.load(std::memory_order_relaxed))
+        {
+            const auto task = FindTask(worker, random);
+            if (!task)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            auto& symbol = *symbols_[*task];
+            {
+                std::lock_guard lock{ symbol.mutex_ };
+                std::swap(symbol.pending_, symbol.running_);
+            }
+            std::size_t applied = symbol.running_.size();
+            for (const auto& command : symbol.running_)
+            {
+                if (!symbol.cancels_.IsEmpty()) [[unlikely]]
+                    applied += symbol.cancels_.Drain(symbol.orderbook_);
+                const Trades trades = ApplyCommand(symbol.orderbook_, command);
+                if (onTrades_ && !trades.empty())
+                    onTrades_(*task, trades);
+            }
+            applied += symbol.cancels_.Drain(symbol.orderbook_);
+            symbol.running_.clear();
+
+            bool more = false;
+            {
+                std::lock_guard lock{ symbol.mutex_ };
+                more = !symbol.pending_.empty() || !symbol.cancels_.IsEmpty();
+                symbol.scheduled_ = more;
+            }
+            if (more) //One batch per turn so a hot book cannot starve the rest. Others can steal it from here
+                worker.deque_.Push(*task);
+            worker.applied_.fetch_add(applied, std::memory_order_relaxed);
+            completed_.fetch_add(applied, std::memory_order_release);
+        }
+    }
+
+    bool stealing_;
+    TradeHandler onTrades_;
+    std::vector<std::unique_ptr<Symbol>> symbols_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> stopping_{ false };
+    std::atomic<std::uint64_t> submitted_{ 0 };
+    std::atomic<std::uint64_t> completed_{ 0 };
+    std::atomic<std::uint64_t> steals_{ 0 };
+};
+
+//Benchmarks, run with --bench
+//Deep single ask level, small buy orders hitting it. Level is topped back up between rounds, only the aggressive AddOrder is timed
+template <typename AllocationPolicy>
+void BenchmarkAllocation(const char* name, std::size_t levelDepth, std::size_t rounds)
+{
+    using Clock = std::chrono::steady_clock;
+    BasicOrderbook<AllocationPolicy> orderbook;
+    std::mt19937 random{ 42 };
+    std::uniform_int_distribution<Quantity> restingSize{ 1, 100 };
+    OrderId nextOrderId = 1;
+
+    auto TopUp = [&]()
+    {
+        while (orderbook.Size() < levelDepth)
+            orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, nextOrderId++, Side::Sell, 100, restingSize(random)));
+    };
+
+    Clock::duration elapsed{ 0 };
+    std::size_t trades = 0;
+    for (std::size_t round = 0; round < rounds; ++round)
+    {
+        TopUp();
+        auto order = std::make_shared<Order>(OrderType::FillandKill, nextOrderId++, Side::Buy, 100, static_cast<Quantity>(levelDepth * 5));
+        const auto start = Clock::now();
+        trades += orderbook.AddOrder(order).size();
+        elapsed += Clock::now() - start;
     }
-    //Modify order
-    Trades MatchOrder(OrderModify order)
+
+    const double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+    std::cout << std::left << std::setw(12) << name << " depth " << std::setw(6) << levelDepth
+        << std::fixed << std::setprecision(0) << std::setw(10) << nanoseconds << " ns/order "
+        << std::setprecision(1) << static_cast<double>(trades) / rounds << " fills/order" << std::endl;
+}
+
+//Primary plus a forked standby process reading a shared memory ring. Times publish + apply on the primary, and the standby's promotion
+void BenchmarkReplication(std::size_t commands)
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr std::size_t capacity = 1 << 16;
+    SharedMemory memory{ CommandRing::BytesFor(capacity) };
+    CommandRing& ring = *CommandRing::Create(memory.Get(), capacity);
+
+    std::cout.flush(); //Child would print anything still buffered a second time
+    const pid_t standby = fork();
+    if (standby < 0)
+        throw std::runtime_error("Cannot fork standby");
+    if (standby == 0)
     {
-        if (orders_.find(order.GetOrderId()) == orders_.end())
-            return { }; //Order does not exist, cannot modify
+        ReplicationStandby<Orderbook> replica{ ring };
+        while (!ring.IsClosed())
+            replica.Poll();
+        const auto start = Clock::now();
+        const bool promoted = replica.Promote() != nullptr;
+        const double microseconds = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        std::cout << "standby      promoted in " << std::fixed << std::setprecision(1) << microseconds << " us at sequence "
+            << replica.GetSequence() << (promoted ? ", checksums matched" : ", replica not usable") << std::endl;
+        _exit(promoted ? 0 : 1);
+    }
 
-        const auto& [existingOrder, _] = orders_.at(order.GetOrderId());
-        CancelOrder(order.GetOrderId());
-        return AddOrder(order.ToOrderPointer(existingOrder->GetOrderType()));
+    Orderbook orderbook;
+    ReplicationPrimary<Orderbook> primary{ orderbook, ring };
+    std::mt19937 random{ 42 };
+    std::vector<OrderId> live;
+    OrderId nextOrderId = 1;
+    const auto start = Clock::now();
+    for (std::size_t command = 0; command < commands; ++command)
+    {
+        if (!live.empty() && random() % 3 == 0)
+        {
+            const std::size_t index = random() % live.size();
+            primary.CancelOrder(live[index]);
+            live[index] = live.back();
+            live.pop_back();
+            continue;
+        }
+        const Side side = random() % 2 ? Side::Buy : Side::Sell;
+        const Price price = side == Side::Buy ? 90 + static_cast<Price>(random() % 12) : 99 + static_cast<Price>(random() % 12);
+        live.push_back(nextOrderId);
+        primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, nextOrderId++, side, price, 1 + random() % 100));
     }
+    const auto elapsed = Clock::now() - start;
+    primary.Checkpoint();
+    ring.Close();
 
-    //Know how. many orders
-    std::size_t Size() const { return orders_.size(); }
+    int status = 0;
+    waitpid(standby, &status, 0);
+    const double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count() / commands;
+    std::cout << "primary      " << std::fixed << std::setprecision(0) << nanoseconds << " ns/command, "
+        << primary.GetDroppedCount() << " dropped, standby " << (WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "consistent" : "failed") << std::endl;
+}
 
-    //Get current state of order book
-    OrderbookLevelInfos GetOrderInfos() const
-    { 
-        LevelInfos bidInfos, askInfos;
-        bidInfos.reserve(bids_.size());
-        askInfos.reserve(asks_.size());
+//Depth queries over 100 displayed levels per side. Book does not change between queries, so the ladders are built once
+void BenchmarkDepthQueries(std::size_t queries)
+{
+    using Clock = std::chrono::steady_clock;
+    Orderbook orderbook;
+    std::mt19937 random{ 42 };
+    OrderId nextOrderId = 1;
+    for (Price level = 0; level < 100; ++level)
+    {
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, nextOrderId++, Side::Buy, 1000 - level, 1 + random() % 500));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, nextOrderId++, Side::Sell, 1001 + level, 1 + random() % 500));
+    }
 
-        //apply same function to bids and asks
-        auto CreateLevelInfos = [](Price price, const OrderPointers& orders)
-        { 
-            return LevelInfo{ price, std::accumulate(orders.begin(), orders.end(), (Quantity)0,
-            [](Quantity runningSum, const OrderPointer& order)
-            { return runningSum + order -> GetRemainingQuantity(); } ) }; //Want remaining to see ho wmuch is aggregate left on this level
-            };
+    [[maybe_unused]] volatile double sink = 0; //Keeps the queries from being optimized away
+    auto start = Clock::now();
+    for (std::size_t query = 0; query < queries; ++query)
+        sink = orderbook.EstimateFill(query % 2 ? Side::Buy : Side::Sell, static_cast<Quantity>(20000 + query % 4000)).averagePrice_;
+    const double fillNanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / queries;
+    start = Clock::now();
+    for (std::size_t query = 0; query < queries; ++query)
+        sink = orderbook.GetQuantityWithin(query % 2 ? Side::Buy : Side::Sell, 90 + query % 8);
+    const double withinNanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / queries;
+    std::cout << "depth query  " << std::fixed << std::setprecision(1) << fillNanoseconds << " ns/fill estimate, "
+        << withinNanoseconds << " ns/quantity within (100 levels a side"
+#if defined(__AVX2__)
+        << ", avx2)"
+#else
+        << ", scalar)"
+#endif
+        << std::endl;
+}
+
+//One hardware counter for the calling thread, through perf_event_open. Not open where perf is not allowed (containers,
+//perf_event_paranoid), then it reads nothing
+class PerfCounter
+{
+public:
+    PerfCounter(std::uint32_t type, std::uint64_t config)
+    {
+#if defined(__linux__)
+        perf_event_attr attributes{ };
+        attributes.size = sizeof(attributes);
+        attributes.type = type;
+        attributes.config = config;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        descriptor_ = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#else
+        (void)type;
+        (void)config;
+#endif
+    }
+
+    ~PerfCounter()
+    {
+        if (descriptor_ >= 0)
+            close(descriptor_);
+    }
 
-        for (const auto& [price, orders] : bids_)
-            bidInfos.push_back(CreateLevelInfos(price, orders));
-        for (const auto& [price, orders] : asks_)
-            askInfos.push_back(CreateLevelInfos(price, orders));
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
 
-        return OrderbookLevelInfos{ bidInfos, askInfos };
+    bool IsOpen() const { return descriptor_ >= 0; }
+
+    void Start()
+    {
+#if defined(__linux__)
+        if (IsOpen())
+        {
+            ioctl(descriptor_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(descriptor_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    std::optional<std::uint64_t> Stop()
+    {
+#if defined(__linux__)
+        std::uint64_t count = 0;
+        if (IsOpen() && ioctl(descriptor_, PERF_EVENT_IOC_DISABLE, 0) == 0 && read(descriptor_, &count, sizeof(count)) == sizeof(count))
+            return count;
+#endif
+        return std::nullopt;
     }
+
+private:
+    int descriptor_{ -1 };
 };
 
-int main()
+//Deep book churned by cancels, re-adds and the odd sweep, once off the heap and once out of a BookMemory arena. Reports
+//dTLB load misses alongside the time where perf counters can be read
+void BenchmarkArena(std::size_t restingOrders, std::size_t operations)
+{
+    using Clock = std::chrono::steady_clock;
+    auto Run = [restingOrders, operations](const std::string& name, std::pmr::memory_resource* memory)
+    {
+        Orderbook orderbook{ PriceSpec{ }, memory };
+        std::mt19937_64 random{ 47 };
+        OrderId nextOrderId = 1;
+        std::vector<OrderId> resting(restingOrders);
+        auto AddResting = [&]()
+        {
+            const Side side = random() % 2 ? Side::Buy : Side::Sell;
+            const Price price = side == Side::Buy ? 1000 - static_cast<Price>(random() % 2000) : 1001 + static_cast<Price>(random() % 2000);
+            orderbook.AddOrder(orderbook.MakeOrder(OrderType::GoodTillCancel, nextOrderId, side, price, 1 + random() % 100));
+            return nextOrderId++;
+        };
+        for (auto& orderId : resting)
+            orderId = AddResting();
+
+#if defined(__linux__)
+        PerfCounter misses{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+#else
+        PerfCounter misses{ 0, 0 };
+#endif
+        const auto start = Clock::now();
+        misses.Start();
+        for (std::size_t operation = 0; operation < operations; ++operation)
+        {
+            auto& orderId = resting[random() % resting.size()];
+            orderbook.CancelOrder(orderId); //Might have traded already, then it is a lookup miss
+            orderId = AddResting();
+            if (operation % 64 == 0)
+            {
+                const Side side = random() % 2 ? Side::Buy : Side::Sell;
+                orderbook.AddOrder(orderbook.MakeOrder(OrderType::FillandKill, nextOrderId++, side, side == Side::Buy ? 3000 : -1000, 200));
+            }
+        }
+        const auto missCount = misses.Stop();
+        const double nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / operations;
+        std::cout << name << std::fixed << std::setprecision(1) << nanoseconds << " ns/cancel+add, dTLB load misses ";
+        if (missCount)
+            std::cout << *missCount;
+        else
+            std::cout << "n/a (perf counters not readable)";
+        std::cout << std::endl;
+    };
+
+    Run("arena off    ", std::pmr::get_default_resource());
+    BookMemory memory{ restingOrders * 1024 };
+    static constexpr const char* Backings[] = { "huge pages", "transparent huge pages", "4k pages" };
+    Run(std::string{ "arena on     (" } + Backings[static_cast<int>(memory.GetArena().GetBacking())] + ") ", memory.GetResource());
+}
+
+//Zipf skewed flow over many books, static sharding against work stealing on the same executor. Everything is posted
+//from one thread and the time runs until the last command has been applied
+void BenchmarkExecutor(std::size_t symbols, std::size_t commands, double skew)
+{
+    using Clock = std::chrono::steady_clock;
+    const std::size_t workers = std::clamp<std::size_t>(std::thread::hardware_concurrency(), 2, 8);
+    std::mt19937_64 random{ 49 };
+    std::vector<double> weights(symbols);
+    for (std::size_t rank = 0; rank < symbols; ++rank)
+        weights[rank] = 1.0 / std::pow(static_cast<double>(rank + 1), skew);
+    std::discrete_distribution<std::size_t> pickRank{ weights.begin(), weights.end() };
+    std::vector<std::size_t> symbolOfRank(symbols); //Hot symbols land on arbitrary shards, as they would by listing order
+    std::iota(symbolOfRank.begin(), symbolOfRank.end(), 0);
+    std::shuffle(symbolOfRank.begin(), symbolOfRank.end(), random);
+
+    std::vector<std::pair<std::size_t, BookCommand>> flow;
+    flow.reserve(commands);
+    std::vector<OrderId> nextOrderId(symbols, 1);
+    for (std::size_t command = 0; command < commands; ++command)
+    {
+        const std::size_t symbol = symbolOfRank[pickRank(random)];
+        BookCommand entry;
+        if (command % 4 == 3 && nextOrderId[symbol] > 1)
+        {
+            entry.type_ = CommandType::Cancel;
+            entry.orderId_ = 1 + random() % (nextOrderId[symbol] - 1);
+        }
+        else
+        {
+            const Side side = random() % 2 ? Side::Buy : Side::Sell;
+            const Price price = 950 + static_cast<Price>(random() % 100);
+            entry = BookCommand::FromOrder(Order{ OrderType::GoodTillCancel, nextOrderId[symbol]++, side, price, static_cast<Quantity>(1 + random() % 100) });
+        }
+        flow.emplace_back(symbol, entry);
+    }
+
+    auto Run = [&](bool stealing)
+    {
+        SymbolExecutor<Orderbook> executor{ symbols, workers, stealing };
+        const auto start = Clock::now();
+        for (const auto& [symbol, command] : flow)
+            executor.Post(symbol, command);
+        executor.Drain();
+        const double milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        std::uint64_t busiest = 0;
+        for (std::size_t worker = 0; worker < executor.GetWorkerCount(); ++worker)
+            busiest = std::max(busiest, executor.GetAppliedCount(worker));
+        std::cout << std::fixed << std::setprecision(1) << milliseconds << " ms (busiest worker " << 100.0 * busiest / commands << "%";
+        if (stealing)
+            std::cout << ", " << executor.GetStealCount() << " steals";
+        std::cout << ")";
+    };
+    std::cout << "executor     static ";
+    Run(false);
+    std::cout << ", stealing ";
+    Run(true);
+    std::cout << ", " << workers << " workers, " << symbols << " symbols, zipf " << std::setprecision(2) << skew << std::endl;
+}
+
+//A risk thread cancels resting orders one by one while the owning thread keeps adding and cancelling its own flow,
+//draining the cancel queue before each normal command. Latency is from post to applied
+void BenchmarkCancelQueue(std::size_t cancels)
+{
+    Orderbook orderbook;
+    CancelQueue queue{ 1024 };
+    std::mt19937 random{ 50 };
+    for (OrderId orderId = 1; orderId <= cancels; ++orderId)
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Buy, 900 + static_cast<Price>(random() % 100), 1 + random() % 100));
+
+    std::thread risk{ [&queue, cancels]
+    {
+        for (OrderId orderId = 1; orderId <= cancels; ++orderId)
+        {
+            while (!queue.TryCancel(orderId))
+                std::this_thread::yield();
+            if (orderId % 16 == 0)
+                std::this_thread::yield(); //Arrive in bursts rather than all at once
+        }
+    } };
+
+    OrderId nextOrderId = cancels + 1;
+    std::size_t drained = 0;
+    while (drained < cancels)
+    {
+        drained += queue.Drain(orderbook);
+        const OrderId orderId = nextOrderId++;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Sell, 1001 + static_cast<Price>(random() % 100), 1 + random() % 100));
+        if (orderId > cancels + 1) //Book stays the same size
+            orderbook.CancelOrder(orderId - 1);
+    }
+    risk.join();
+
+    const auto& latency = queue.GetLatency();
+    std::cout << "cancel queue p50 <" << latency.GetPercentile(0.5) + 1 << " ns, p99 <" << latency.GetPercentile(0.99) + 1
+        << " ns, max " << latency.GetMax() << " ns, mean " << std::fixed << std::setprecision(1) << latency.GetMean()
+        << " ns over " << latency.GetCount() << " cancels, " << orderbook.Size() << " orders left" << std::endl;
+}
+
+//Cost of one timestamp read, calibrated TSC against steady_clock
+void BenchmarkClocks(std::size_t reads)
+{
+    using Clock = std::chrono::steady_clock;
+    const TscClock& tsc = TscClock::Get();
+    [[maybe_unused]] volatile Timestamp sink = 0;
+    auto start = Clock::now();
+    for (std::size_t read = 0; read < reads; ++read)
+        sink = tsc.Now();
+    const double tscNanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / reads;
+    start = Clock::now();
+    for (std::size_t read = 0; read < reads; ++read)
+        sink = static_cast<Timestamp>(Clock::now().time_since_epoch().count());
+    const double steadyNanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / reads;
+    std::cout << "clock read   " << std::fixed << std::setprecision(1) << tscNanoseconds << " ns tsc, "
+        << steadyNanoseconds << " ns steady_clock" << std::endl;
+}
+
+void RunBenchmarks()
+{
+    for (std::size_t depth : { 100, 1000, 10000 })
+    {
+        BenchmarkAllocation<FifoAllocation>("fifo", depth, 2000);
+        BenchmarkAllocation<ProRataAllocation>("pro-rata", depth, 2000);
+        BenchmarkAllocation<TopOrderProRataAllocation>("top+pro-rata", depth, 2000);
+    }
+    BenchmarkReplication(1000000);
+    BenchmarkDepthQueries(1000000);
+    BenchmarkClocks(10000000);
+    BenchmarkArena(200000, 2000000);
+    BenchmarkExecutor(1000, 2000000, 1.1);
+    BenchmarkCancelQueue(200000);
+}
+
+//Discovered topology and where n shards would go on it
+void PrintTopology(std::size_t shards)
+{
+    CpuTopology topology = CpuTopology::Discover();
+    topology.RestrictToAffinity();
+    for (int node : topology.GetNodes())
+    {
+        std::cout << "node " << node << ":";
+        for (const auto& core : topology.GetCores(node))
+        {
+            std::cout << " [";
+            for (std::size_t thread = 0; thread < core.size(); ++thread)
+                std::cout << (thread ? " " : "") << core[thread];
+            std::cout << "]";
+        }
+        std::cout << std::endl;
+    }
+    const auto placements = PlanShards(topology, shards);
+    for (std::size_t shard = 0; shard < placements.size(); ++shard)
+    {
+        const auto& placement = placements[shard];
+        std::cout << "shard " << shard << ": node " << placement.node_ << ", matcher cpu " << placement.matcherCpu_
+            << ", gateway cpu " << placement.gatewayCpu_ << ", publisher cpu " << placement.publisherCpu_ << std::endl;
+    }
+}
+
+//Regression checks for edge cases the matching loop has got wrong before. Prints each failure, returns how many failed
+int RunChecks()
+{
+    int failures = 0;
+    auto Expect = [&failures](bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::cout << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    };
+
+    //Post-only reprice when the only crossing interest is a peg: no ask level to step behind, or a worse one
+    for (const bool worseAsk : { false, true })
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 99, 10));
+        if (worseAsk)
+            orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 110, 10));
+        auto peg = std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Sell, 0, 10);
+        peg->SetPeg(PegReference::Market, 2); //Sell market peg follows the bid, at 101
+        orderbook.AddOrder(peg);
+
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 4, Side::Buy, 105, 10);
+        order->AddAttributes(OrderAttribute::PostOnlyReprice);
+        const auto trades = orderbook.AddOrder(order);
+        Expect(trades.empty(), "post-only reprice behind a peg takes no liquidity");
+        Expect(order->GetPrice() == 100, "post-only reprice steps one tick behind the peg");
+        const auto infos = orderbook.GetOrderInfos();
+        const auto& bids = infos.GetBids();
+        Expect(!bids.empty() && bids.front().price_ == 100 && bids.front().quantity_ == 10, "repriced post-only order rests at the new price");
+    }
+
+    //Risk gate as listener, with orders from owners outside its table reaching the book directly
+    {
+        Orderbook orderbook;
+        RiskGate gate{ 4 };
+        orderbook.SetListener(&gate);
+        auto Add = [&orderbook](OrderId orderId, Side side, OwnerId owner)
+        {
+            auto order = std::make_shared<Order>(OrderType::GoodTillCancel, orderId, side, 100, 10);
+            order->SetOwner(owner);
+            return orderbook.AddOrder(order);
+        };
+        Add(1, Side::Buy, 1000);
+        Add(2, Side::Buy, 1);
+        const auto trades = Add(3, Side::Sell, 1000);
+        orderbook.CancelOrder(2);
+        Expect(trades.size() == 1, "unknown owner still trades");
+        Expect(gate.GetOpenOrders(1) == 0 && gate.GetPosition(1) == 0, "known owner counters untouched by unknown owners");
+    }
+
+    //Range cancel reaches all-or-none orders waiting off the price levels
+    {
+        Orderbook orderbook;
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10);
+        order->AddAttributes(OrderAttribute::AllOrNone);
+        orderbook.AddOrder(order);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 80, 10));
+        Expect(orderbook.CancelRange(Side::Buy, 90, 110) == 1 && orderbook.Size() == 1, "range cancel removes all-or-none orders in range");
+    }
+
+    //Trailing stop on a replicated primary fires the same way on the standby
+    {
+        SharedMemory memory{ CommandRing::BytesFor(64) };
+        CommandRing& ring = *CommandRing::Create(memory.Get(), 64);
+        Orderbook orderbook;
+        ReplicationPrimary<Orderbook> primary{ orderbook, ring };
+        ReplicationStandby<Orderbook> standby{ ring };
+        primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 1));
+        primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 100, 1)); //Last trade 100
+        primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 94, 10));
+        primary.AddTrailingStop(std::make_shared<Order>(OrderType::GoodTillCancel, 4, Side::Sell, 90, 5), TrailingOffset{ TrailingOffsetType::Fixed, 5 });
+        primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 5, Side::Sell, 94, 1)); //Prints 94, fires the stop
+        primary.Checkpoint();
+        standby.Poll();
+        Expect(orderbook.GetTrailingStopCount() == 0, "trailing stop fires on the primary");
+        Expect(standby.GetState() == ReplicaState::Following && standby.GetOrderbook().GetChecksum() == orderbook.GetChecksum(), "standby follows a fired trailing stop");
+    }
+
+    //Modify keeps the minimum-quantity flag only on orders that had it, and the minimum holds under post-only
+    {
+        struct LastAdded : OrderbookListener
+        {
+            void OnOrderAdded(const Order& order) override { attributes_ = order.GetAttributes(); }
+            OrderAttribute attributes_{ OrderAttribute::None };
+        } listener;
+        Orderbook orderbook;
+        orderbook.SetListener(&listener);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        orderbook.MatchOrder(OrderModify(1, Side::Buy, 101, 10));
+        Expect(listener.attributes_ == OrderAttribute::None, "modify adds no attributes");
+
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 100, 20);
+        order->AddAttributes(OrderAttribute::PostOnlyReprice);
+        order->SetMinimumQuantity(15);
+        orderbook.AddOrder(order);
+        Expect(orderbook.Size() == 1, "post-only does not skip the minimum-quantity check");
+    }
+
+    //All-or-none never counts own liquidity self-trade prevention would take away, so it cannot be left part filled on a level
+    for (const auto type : { OrderType::FillandKill, OrderType::GoodTillCancel })
+    {
+        Orderbook orderbook;
+        orderbook.SetSelfTradePrevention(SelfTradePrevention::CancelResting);
+        auto Add = [&orderbook](OrderId orderId, OrderType orderType, Side side, OwnerId owner, OrderAttribute attributes)
+        {
+            auto order = std::make_shared<Order>(orderType, orderId, side, 100, side == Side::Buy ? 10 : 5);
+            order->SetOwner(owner);
+            order->AddAttributes(attributes);
+            return orderbook.AddOrder(order);
+        };
+        Add(1, OrderType::GoodTillCancel, Side::Sell, 2, OrderAttribute::None);
+        Add(2, OrderType::GoodTillCancel, Side::Sell, 1, OrderAttribute::None);
+        const auto trades = Add(3, type, Side::Buy, 1, OrderAttribute::AllOrNone);
+        Expect(trades.empty() && orderbook.Size() == (type == OrderType::FillandKill ? 2u : 3u), "all-or-none skips own liquidity under self-trade prevention");
+    }
+
+    //Nor liquidity past what the price band lets it print
+    {
+        Orderbook orderbook;
+        PriceBandConfig band;
+        band.widthBasisPoints_ = 100;
+        band.initialReference_ = 100;
+        orderbook.SetPriceBand(band);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 5));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 102, 5));
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 102, 10);
+        order->AddAttributes(OrderAttribute::AllOrNone);
+        const auto trades = orderbook.AddOrder(order);
+        Expect(trades.empty() && order->GetRemainingQuantity() == 10, "all-or-none waits rather than run into the band");
+    }
+
+    //All-or-none orders that waited through an auction are looked at again once it uncrosses
+    {
+        Orderbook orderbook;
+        orderbook.StartAuction();
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10);
+        order->AddAttributes(OrderAttribute::AllOrNone);
+        orderbook.AddOrder(order);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 100, 10));
+        const auto trades = orderbook.Uncross();
+        Expect(trades.size() == 1 && orderbook.Size() == 0, "uncross fills waiting all-or-none orders");
+    }
+
+    //Modified and replayed orders come from the book's memory, not the global heap
+    {
+        struct CountingResource : std::pmr::memory_resource
+        {
+            void* do_allocate(std::size_t bytes, std::size_t alignment) override
+            {
+                ++allocations_;
+                return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+            }
+            void do_deallocate(void* pointer, std::size_t bytes, std::size_t alignment) override { std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment); }
+            bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+            std::size_t allocations_{ 0 };
+        } replayed, made;
+        //Same steps on a book fed with MakeOrder take exactly as many allocations from its memory
+        Orderbook replayedBook{ PriceSpec{ }, &replayed };
+        ApplyCommand(replayedBook, BookCommand::FromOrder(Order{ OrderType::GoodTillCancel, 1, Side::Buy, 100, 10 }));
+        replayedBook.MatchOrder(OrderModify(1, Side::Buy, 101, 10));
+        Orderbook madeBook{ PriceSpec{ }, &made };
+        madeBook.AddOrder(madeBook.MakeOrder(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        madeBook.CancelOrder(1);
+        madeBook.AddOrder(madeBook.MakeOrder(OrderType::GoodTillCancel, 1, Side::Buy, 101, 10));
+        Expect(replayed.allocations_ == made.allocations_, "replayed and modified orders use the book's memory");
+    }
+
+    //Rejected orders take no sequence number
+    {
+        Orderbook orderbook{ PriceSpec{ 5 } };
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 101, 10)); //Off the tick
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 2, Side::Buy, 100, 10)); //Nothing to match
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 100, 10);
+        orderbook.AddOrder(order);
+        Expect(order->GetSequence() == 1 && orderbook.GetSequence() == 1, "sequence counts accepted orders only");
+    }
+
+    //Pegs with offsets toward each other never end up crossed
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 104, 10));
+        auto buy = std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 0, 10);
+        buy->SetPeg(PegReference::Primary, 3);
+        auto sell = std::make_shared<Order>(OrderType::GoodTillCancel, 4, Side::Sell, 0, 10);
+        sell->SetPeg(PegReference::Primary, -3);
+        orderbook.AddOrder(buy);
+        orderbook.AddOrder(sell);
+        const auto infos = orderbook.GetOrderInfos();
+        Expect(!infos.GetBids().empty() && !infos.GetAsks().empty() && infos.GetBids().front().price_ < infos.GetAsks().front().price_, "opposite pegs stay uncrossed");
+    }
+
+    //An off-tick auction reference is rounded to the tick before it can become the uncross price
+    {
+        Orderbook orderbook{ PriceSpec{ 2 } };
+        orderbook.StartAuction();
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 98, 10));
+        const auto result = orderbook.GetIndicativeUncross(99);
+        const auto trades = orderbook.Uncross(99);
+        Expect(result && result->price_ == 100 && trades.size() == 1 && trades.front().GetBidTrade().price_ == 100, "uncross reference is rounded to the tick");
+    }
+
+    //Iceberg shows one slice at a time and goes to the back of its level when the slice runs out
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 30, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 100, 10));
+        const auto first = orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 3, Side::Buy, 100, 10));
+        const auto infos = orderbook.GetOrderInfos();
+        const auto second = orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 4, Side::Buy, 100, 10));
+        Expect(first.size() == 1 && first.front().GetAskTrade().orderId_ == 1, "iceberg slice trades first");
+        Expect(infos.GetAsks().size() == 1 && infos.GetAsks().front().quantity_ == 20, "only the iceberg's slice is displayed");
+        Expect(second.size() == 1 && second.front().GetAskTrade().orderId_ == 2, "replenished iceberg queues behind the level");
+    }
+
+    //GTD orders expire through the wheel when the clock reaches them, DAY orders at session end
+    {
+        Orderbook orderbook;
+        auto gtd = std::make_shared<Order>(OrderType::GoodTillDate, 1, Side::Buy, 100, 10);
+        gtd->SetExpiry(5'000'000);
+        orderbook.AddOrder(gtd);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodForDay, 2, Side::Buy, 99, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 98, 10));
+        Expect(orderbook.AdvanceTime(4'000'000).empty(), "GTD order stays until its expiry");
+        Expect(orderbook.AdvanceTime(5'000'000) == OrderIds{ 1 }, "GTD order expires at its timestamp");
+        Expect(orderbook.EndSession(10'000'000) == 1 && orderbook.Size() == 1, "DAY order expires at session end");
+    }
+
+    //Mass cancels by owner, price range and side
+    {
+        Orderbook orderbook;
+        auto Add = [&orderbook](OrderId orderId, Side side, Price price, OwnerId owner)
+        {
+            auto order = std::make_shared<Order>(OrderType::GoodTillCancel, orderId, side, price, 10);
+            order->SetOwner(owner);
+            orderbook.AddOrder(order);
+        };
+        Add(1, Side::Buy, 100, 7);
+        Add(2, Side::Buy, 99, 7);
+        Add(3, Side::Buy, 99, 8);
+        Add(4, Side::Buy, 95, 8);
+        Add(5, Side::Sell, 105, 8);
+        Expect(orderbook.CancelAll(7) == 2 && orderbook.Size() == 3, "cancel all removes only the owner's orders");
+        Expect(orderbook.CancelRange(Side::Buy, 96, 100) == 1 && orderbook.Size() == 2, "range cancel stays inside the range");
+        Expect(orderbook.CancelSide(Side::Sell) == 1 && orderbook.Size() == 1, "side cancel leaves the other side");
+    }
+
+    //Uncross picks the price with the most volume and leaves the imbalance resting
+    {
+        Orderbook orderbook;
+        orderbook.StartAuction();
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 102, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 101, 5));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Sell, 100, 8));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 4, Side::Sell, 101, 10));
+        const auto result = orderbook.GetIndicativeUncross();
+        Expect(result && result->price_ == 101 && result->volume_ == 15 && result->imbalance_ == -3, "indicative uncross price, volume and imbalance");
+        const auto trades = orderbook.Uncross();
+        Quantity volume = 0;
+        bool onePrice = true;
+        for (const auto& trade : trades)
+        {
+            volume += trade.GetBidTrade().quantity_;
+            onePrice &= trade.GetBidTrade().price_ == 101 && trade.GetAskTrade().price_ == 101;
+        }
+        const auto infos = orderbook.GetOrderInfos();
+        Expect(volume == 15 && onePrice, "uncross executes everything at one price");
+        Expect(infos.GetBids().empty() && infos.GetAsks().size() == 1 && infos.GetAsks().front().quantity_ == 3, "imbalance is left resting");
+        Expect(orderbook.GetTradingPhase() == TradingPhase::Continuous, "book is continuous after uncross");
+    }
+
+    //Pro-rata shares the aggressor by size, rounding leftovers go one lot at a time in time priority
+    {
+        BasicOrderbook<ProRataAllocation> orderbook;
+        for (OrderId orderId = 1; orderId <= 3; ++orderId)
+            orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Sell, 100, 10));
+        const auto trades = orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 4, Side::Buy, 100, 16));
+        std::map<OrderId, Quantity> filled;
+        for (const auto& trade : trades)
+            filled[trade.GetAskTrade().orderId_] += trade.GetAskTrade().quantity_;
+        Expect((filled == std::map<OrderId, Quantity>{ { 1, 6 }, { 2, 5 }, { 3, 5 } }), "pro-rata remainder goes to the oldest order");
+
+        Quantity allocations[3];
+        const Quantity resting[3] = { 1, 1, 1 };
+        TopOrderProRataAllocation::Allocate(resting, 3, 2, allocations);
+        Expect(allocations[0] == 1 && allocations[1] == 1 && allocations[2] == 0, "top order first, then pro-rata with leftovers in time order");
+    }
+
+    //Self-trade prevention replaces the trade with the configured action
+    for (const auto mode : { SelfTradePrevention::CancelResting, SelfTradePrevention::CancelAggressor, SelfTradePrevention::CancelBoth, SelfTradePrevention::Decrement })
+    {
+        Orderbook orderbook;
+        orderbook.SetSelfTradePrevention(mode);
+        auto resting = std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 10);
+        resting->SetOwner(1);
+        orderbook.AddOrder(resting);
+        auto aggressor = std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 100, 4);
+        aggressor->SetOwner(1);
+        const auto trades = orderbook.AddOrder(aggressor);
+        const std::size_t expected = mode == SelfTradePrevention::CancelResting ? 1 : mode == SelfTradePrevention::CancelAggressor ? 1 : mode == SelfTradePrevention::CancelBoth ? 0 : 1;
+        Expect(trades.empty() && orderbook.Size() == expected, "self-trade prevention never prints a trade");
+        if (mode == SelfTradePrevention::Decrement)
+            Expect(resting->GetRemainingQuantity() == 6, "decrement takes the smaller quantity off both");
+    }
+
+    //Risk gate checks limits from its own counters
+    {
+        Orderbook orderbook;
+        RiskGate gate{ 4 };
+        orderbook.SetListener(&gate);
+        gate.SetLimits(1, RiskLimits{ 100, 1'000'000, 1, 1000, 1000 });
+        auto Make = [](OrderId orderId, OwnerId owner, Quantity quantity)
+        {
+            auto order = std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Buy, 100, quantity);
+            order->SetOwner(owner);
+            return order;
+        };
+        RiskCheck result;
+        gate.Submit(orderbook, Make(1, 1, 10), &result);
+        Expect(result == RiskCheck::Accepted && gate.GetOpenOrders(1) == 1, "order inside the limits goes through");
+        gate.Submit(orderbook, Make(2, 1, 10), &result);
+        Expect(result == RiskCheck::OpenOrders, "open order limit");
+        orderbook.CancelOrder(1);
+        gate.Submit(orderbook, Make(3, 1, 200), &result);
+        Expect(result == RiskCheck::OrderQuantity, "order size limit");
+        gate.Submit(orderbook, Make(4, 2, 10), &result);
+        Expect(result == RiskCheck::UnknownAccount && orderbook.Size() == 0, "account without limits is refused");
+    }
+
+    //A fill outside the band halts the book into an auction, the aggressor rests
+    {
+        Orderbook orderbook;
+        PriceBandConfig band;
+        band.widthBasisPoints_ = 100;
+        band.initialReference_ = 100;
+        orderbook.SetPriceBand(band);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 5));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 105, 5));
+        const auto trades = orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 105, 10));
+        Expect(trades.size() == 1 && trades.front().GetAskTrade().price_ == 100, "fills inside the band print");
+        Expect(orderbook.GetTradingPhase() == TradingPhase::Auction && orderbook.Size() == 2, "breach halts with the aggressor resting");
+    }
+
+    //Post-only never takes liquidity, hidden size is never displayed and trades after displayed size
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 10));
+        auto hidden = std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 100, 5);
+        hidden->AddAttributes(OrderAttribute::Hidden);
+        orderbook.AddOrder(hidden);
+        auto postOnly = std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 100, 10);
+        postOnly->AddAttributes(OrderAttribute::PostOnly);
+        Expect(orderbook.AddOrder(postOnly).empty() && orderbook.Size() == 2, "post-only order that would take is rejected");
+        const auto infos = orderbook.GetOrderInfos();
+        Expect(infos.GetAsks().size() == 1 && infos.GetAsks().front().quantity_ == 10, "hidden size is left out of the level");
+        const auto trades = orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 4, Side::Buy, 100, 12));
+        Expect(trades.size() == 2 && trades[0].GetAskTrade().orderId_ == 1 && trades[1].GetAskTrade().orderId_ == 2, "hidden trades after displayed");
+    }
+
+    //A primary peg follows the best bid without being touched, and trades at the price it had before the aggressor
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        auto peg = std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 0, 5);
+        peg->SetPeg(PegReference::Primary, 0);
+        orderbook.AddOrder(peg);
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 101, 10));
+        const auto infos = orderbook.GetOrderInfos();
+        Expect(!infos.GetBids().empty() && infos.GetBids().front().price_ == 101 && infos.GetBids().front().quantity_ == 15, "peg moves with the best bid");
+        const auto trades = orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 4, Side::Sell, 101, 15));
+        Expect(trades.size() == 2 && trades[0].GetBidTrade().orderId_ == 3 && trades[1].GetBidTrade().orderId_ == 2, "price level wins the tie with the peg");
+    }
+
+    //Sell trailing stop follows the high and fires once the price falls its offset from it
+    {
+        Orderbook orderbook;
+        OrderId nextOrderId = 1;
+        auto Print = [&orderbook, &nextOrderId](Price price)
+        {
+            orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, nextOrderId++, Side::Sell, price, 1));
+            orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, nextOrderId++, Side::Buy, price, 1));
+        };
+        Print(100);
+        Expect(orderbook.AddTrailingStop(std::make_shared<Order>(OrderType::FillandKill, 1000, Side::Sell, 1, 1), TrailingOffset{ TrailingOffsetType::Fixed, 5 }), "stop accepted after a trade");
+        Print(110);
+        Print(106);
+        Expect(orderbook.GetTrailingStopCount() == 1, "stop holds above high minus offset");
+        Print(105);
+        Expect(orderbook.GetTrailingStopCount() == 0, "stop fires at high minus offset");
+    }
+
+    //All-or-none waits off the levels until its whole size can trade, then takes it in one go
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 5));
+        auto order = std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 100, 10);
+        order->AddAttributes(OrderAttribute::AllOrNone);
+        Expect(orderbook.AddOrder(order).empty() && orderbook.GetOrderInfos().GetBids().empty(), "all-or-none waits and is not displayed");
+        const auto trades = orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Sell, 100, 5));
+        Expect(trades.size() == 2 && orderbook.Size() == 0, "all-or-none fills once its size is there");
+    }
+
+    //Implied in: the spread bid is the near bid minus the far ask, and hitting it trades both legs
+    {
+        Orderbook nearBook, farBook, spreadBook;
+        SpreadCoordinator<Orderbook> coordinator{ nearBook, farBook, spreadBook, 99, 1'000'000 };
+        coordinator.AddOrder(SpreadLeg::Near, std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        coordinator.AddOrder(SpreadLeg::Far, std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 30, 10));
+        const auto implied = coordinator.GetImplied(SpreadLeg::Spread, Side::Buy);
+        Expect(implied && implied->price_ == 70 && implied->quantity_ == 10, "implied spread bid from the outrights");
+        coordinator.AddOrder(SpreadLeg::Spread, std::make_shared<Order>(OrderType::FillandKill, 3, Side::Sell, 70, 4));
+        Expect(nearBook.GetOrderInfos().GetBids().front().quantity_ == 6 && farBook.GetOrderInfos().GetAsks().front().quantity_ == 6, "implied fill trades both legs");
+    }
+
+    //Tick arithmetic: index, tick check, decimal rounding and overflow
+    {
+        const PriceSpec spec{ 5, 2 };
+        Expect(spec.IsOnTick(125) && !spec.IsOnTick(123) && spec.IsOnTick(-15), "tick check");
+        Expect(spec.ToTicks(125) == 25 && spec.FromTicks(25) == 125, "tick index round trip");
+        Expect(spec.FromDecimal(1.23) == 125 && PriceSpec{ 1, 2 }.FromDecimal(123.45) == 12345, "decimal rounds to the nearest tick");
+        Expect(!spec.Offset(std::numeric_limits<Price>::max() - 1, 1), "offset overflow is caught");
+        Orderbook orderbook{ spec };
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 123, 10));
+        Expect(orderbook.Size() == 0, "off-tick order is rejected");
+    }
+
+    //Checksum depends only on the resting orders, not on how the book got there
+    {
+        Orderbook first, second;
+        first.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        first.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 105, 4));
+        second.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 105, 10));
+        second.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Buy, 105, 6));
+        second.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        Expect(first.GetChecksum() == second.GetChecksum(), "same resting orders, same checksum");
+        first.CancelSide(Side::Buy);
+        first.CancelOrder(2);
+        Expect(first.GetChecksum() == 0, "empty book has a zero checksum");
+    }
+
+    //A dropped command leaves the standby in Gap, a book changed outside the stream leaves it Diverged
+    {
+        SharedMemory memory{ CommandRing::BytesFor(2) };
+        CommandRing& ring = *CommandRing::Create(memory.Get(), 2);
+        Orderbook orderbook;
+        ReplicationPrimary<Orderbook> primary{ orderbook, ring };
+        ReplicationStandby<Orderbook> standby{ ring };
+        for (OrderId orderId = 1; orderId <= 3; ++orderId)
+            primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Buy, 100, 10));
+        standby.Poll();
+        primary.CancelOrder(1);
+        standby.Poll();
+        Expect(primary.GetDroppedCount() == 1 && standby.GetState() == ReplicaState::Gap && standby.GetGapStart() == 3, "skipped sequence is a gap");
+        Expect(standby.Promote() == nullptr, "a replica with a gap cannot be promoted");
+    }
+    {
+        SharedMemory memory{ CommandRing::BytesFor(16) };
+        CommandRing& ring = *CommandRing::Create(memory.Get(), 16);
+        Orderbook orderbook;
+        ReplicationPrimary<Orderbook> primary{ orderbook, ring };
+        ReplicationStandby<Orderbook> standby{ ring };
+        standby.GetOrderbook().AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 9, Side::Sell, 120, 1));
+        primary.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 10));
+        primary.Checkpoint();
+        standby.Poll();
+        Expect(standby.GetState() == ReplicaState::Diverged, "checksum mismatch at a checkpoint is divergence");
+    }
+
+    //Visible quantity ahead of an order follows fills and cancels in front of it
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 100, 5));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 3, Side::Sell, 100, 7));
+        Expect(orderbook.QueueAhead(3) == 15 && orderbook.QueueAhead(1) == 0, "queue ahead on entry");
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 4, Side::Buy, 100, 4));
+        Expect(orderbook.QueueAhead(3) == 11, "fill in front shortens the queue");
+        orderbook.CancelOrder(2);
+        Expect(orderbook.QueueAhead(3) == 6 && !orderbook.QueueAhead(2), "cancel in front shortens the queue");
+    }
+
+    //Snapshot of the touch with imbalance and microprice
+    {
+        Orderbook orderbook;
+        orderbook.EnableMarketSnapshot();
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Buy, 100, 30));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 101, 10));
+        const auto snapshot = orderbook.GetMarketSnapshot();
+        Expect(snapshot.bid_ && snapshot.bid_->price_ == 100 && snapshot.ask_ && snapshot.ask_->quantity_ == 10, "snapshot touch");
+        Expect(std::abs(snapshot.imbalance_ - 0.5) < 1e-9 && std::abs(snapshot.microprice_ - 100.75) < 1e-9, "imbalance and microprice");
+        Expect(snapshot.bidDepth_[0] == 30 && snapshot.askDepth_[0] == 10, "depth at the touch");
+    }
+
+    //Fill estimate and depth near the touch from the ladder
+    {
+        Orderbook orderbook;
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 10));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 101, 10));
+        const auto estimate = orderbook.EstimateFill(Side::Buy, 15);
+        Expect(estimate.quantity_ == 15 && estimate.worstPrice_ == 101 && estimate.levels_ == 2 && std::abs(estimate.averagePrice_ - 1505.0 / 15) < 1e-9, "fill estimate over two levels");
+        Expect(orderbook.GetQuantityWithin(Side::Buy, 0) == 10 && orderbook.GetQuantityWithin(Side::Buy, 1) == 20, "depth within ticks of the touch");
+    }
+
+    //Tape keeps each print, the current bar rolls OHLCV and VWAP
+    {
+        Orderbook orderbook;
+        orderbook.EnableTradeTape(16, { 1000 });
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 5));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Sell, 102, 5));
+        orderbook.AddOrder(std::make_shared<Order>(OrderType::FillandKill, 3, Side::Buy, 102, 10));
+        const TradeTape* tape = orderbook.GetTradeTape();
+        Expect(tape && tape->Size() == 2 && tape->GetPrice(0) == 100 && tape->GetSellOrderId(1) == 2, "tape holds every print in order");
+        const auto& bar = tape->GetCurrentBar(0);
+        Expect(bar && bar->open_ == 100 && bar->high_ == 102 && bar->close_ == 102 && bar->volume_ == 10 && std::abs(bar->GetVwap() - 101) < 1e-9, "bar OHLCV and VWAP");
+    }
+
+    //Orders and trades share one sequence and the command's time
+    {
+        Orderbook orderbook;
+        orderbook.SetClock(&TscClock::Get());
+        auto resting = std::make_shared<Order>(OrderType::GoodTillCancel, 1, Side::Sell, 100, 10);
+        orderbook.AddOrder(resting);
+        auto aggressor = std::make_shared<Order>(OrderType::GoodTillCancel, 2, Side::Buy, 100, 10);
+        const auto trades = orderbook.AddOrder(aggressor);
+        Expect(resting->GetSequence() == 1 && aggressor->GetSequence() == 2 && trades.size() == 1 && trades.front().GetSequence() == 3, "trade sequence follows its orders");
+        Expect(aggressor->GetEntryTime() > 0 && trades.front().GetTime() == aggressor->GetEntryTime() && aggressor->GetEntryTime() >= resting->GetEntryTime(), "one clock reading per command");
+    }
+
+    //Book on an arena takes its memory from it
+    {
+        BookMemory memory{ HugePageArena::HugePageSize };
+        Orderbook orderbook{ PriceSpec{ }, memory.GetResource() };
+        for (OrderId orderId = 1; orderId <= 100; ++orderId)
+            orderbook.AddOrder(orderbook.MakeOrder(OrderType::GoodTillCancel, orderId, Side::Buy, 100 - static_cast<Price>(orderId % 10), 10));
+        Expect(memory.GetArena().GetUsed() > 0 && memory.GetArena().GetOverflow() == 0 && orderbook.Size() == 100, "levels, index and orders come from the arena");
+    }
+
+    //cpulist parsing, and a plan from whatever topology is found gives every shard CPUs that exist
+    {
+        Expect((CpuTopology::ParseCpuList("0-3,8,10-11\n") == std::vector<int>{ 0, 1, 2, 3, 8, 10, 11 }), "cpulist ranges");
+        const CpuTopology topology = CpuTopology::Discover("/nonexistent");
+        const auto placements = PlanShards(topology, 2);
+        bool known = placements.size() == 2;
+        for (const auto& placement : placements)
+            for (int cpu : { placement.matcherCpu_, placement.gatewayCpu_, placement.publisherCpu_ })
+                known &= std::any_of(topology.GetCpus().begin(), topology.GetCpus().end(), [cpu](const LogicalCpu& logical) { return logical.cpu_ == cpu; });
+        Expect(!topology.GetCpus().empty() && known, "fallback topology and shard plan");
+    }
+
+    //Executor applies each symbol's commands in posting order, stealing or not
+    for (const bool stealing : { false, true })
+    {
+        SymbolExecutor<Orderbook> executor{ 8, 3, stealing };
+        for (std::size_t symbol = 0; symbol < 8; ++symbol)
+        {
+            for (OrderId orderId = 1; orderId <= 50; ++orderId)
+                executor.Post(symbol, BookCommand::FromOrder(Order{ OrderType::GoodTillCancel, orderId, Side::Buy, 100, 1 }));
+            BookCommand cancel;
+            cancel.type_ = CommandType::Cancel;
+            cancel.orderId_ = 50;
+            executor.Post(symbol, cancel);
+        }
+        executor.Drain();
+        bool inOrder = true;
+        for (std::size_t symbol = 0; symbol < 8; ++symbol)
+            inOrder &= executor.GetOrderbook(symbol).Size() == 49;
+        Expect(inOrder, "every book sees its commands in posting order");
+    }
+
+    //Cancel queue carries cancels from any thread and applies them on drain
+    {
+        Orderbook orderbook;
+        CancelQueue queue{ 4 };
+        for (OrderId orderId = 1; orderId <= 3; ++orderId)
+        {
+            auto order = std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Buy, 100, 10);
+            order->SetOwner(orderId == 3 ? 5 : 4);
+            orderbook.AddOrder(order);
+        }
+        std::thread producer{ [&queue] { queue.TryCancel(1); queue.TryCancelAll(5); } };
+        producer.join();
+        Expect(!queue.IsEmpty() && queue.Drain(orderbook) == 2 && orderbook.Size() == 1 && queue.IsEmpty(), "posted cancels applied on drain");
+        Expect(queue.GetLatency().GetCount() == 2, "latency recorded per request");
+    }
+
+    std::cout << (failures ? "checks failed" : "checks passed") << std::endl;
+    return failures;
+}
+
+int main(int argc, char** argv)
 {
+    if (argc > 1 && std::string{ argv[1] } == "--bench")
+    {
+        RunBenchmarks();
+        return 0;
+    }
+    if (argc > 1 && std::string{ argv[1] } == "--check")
+        return RunChecks() == 0 ? 0 : 1;
+    if (argc > 1 && std::string{ argv[1] } == "--topology")
+    {
+        PrintTopology(argc > 2 ? std::stoul(argv[2]) : 1);
+        return 0;
+    }
+
     Orderbook orderbook;
     const OrderId orderId = 1;
     orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, orderId, Side::Buy, 100, 10));